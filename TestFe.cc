@@ -12,6 +12,7 @@
 #include "midas.h"
 #include "tmfe_rev0.h"
 #include "TopasDevice.hh"
+#include "TopasCommandQueue.hh"
 
 /* Callbacks for when ODB settings change */
 void wavelength_callback(INT hDB, INT hkey, INT index, void *feptr);
@@ -23,6 +24,11 @@ class feTopasDevice : public TMFePeriodicHandlerInterface
 private:
     //const char* fSerialNumber{"P23894"};
     const char* fSerialNumber{"Orpheus-F-Demo-9388"};
+    const int fTelemetryPeriodMs{500};  //  how often the device is polled in the background
+    const int fTelemetryMaxAgeMs{2000};  //  older samples count as a communication failure
+    const float fWavelengthDeadbandNm{0.1f};  //  smaller wavelength changes are not written to the ODB
+    std::atomic<bool> fStateChanged{true};  //  set by the device observers, cleared by HandlePeriodic
+    bool fCommunicationOk{false};
 public:
     TMFE* fMfe;
     TMFeEquipment* fEq;
@@ -31,6 +37,9 @@ public:
     char* fEventBuf;
 
     TopasDevice* laserEquipment{nullptr};  //  Using nullptr instead of NULL (C++11 practice. More type-safe)
+    TopasCommandQueue* commandQueue{nullptr};  //  setpoint changes from the ODB callbacks, latest target wins
+    std::shared_ptr<TopasLocator> discovery;  //  keeps track of the device address in the background
+    std::shared_ptr<TopasDiscoveryCache> discoveryCache;  //  last known address, so a restart can skip discovery
 
 public:
     feTopasDevice(TMFE* mfe, TMFeEquipment* eq) // ctor
@@ -43,6 +52,7 @@ public:
 
     ~feTopasDevice() // dtor
     {
+        if (commandQueue) {delete commandQueue;}  //  uses laserEquipment, so it goes first
         if (laserEquipment) {delete laserEquipment;}
 
         if (fEventBuf){
@@ -83,11 +93,16 @@ public:
 
         // Create the TopasDevice object and connect to it (done in constructor, as of right now)
         laserEquipment = new TopasDevice();
-        laserEquipment->initializeWithSerialNumber(fSerialNumber);
+        discoveryCache = std::make_shared<TopasDiscoveryCache>();
+        discovery = std::make_shared<TopasLocator>();
+        discovery->setCache(discoveryCache);
+        discovery->startService();
+        laserEquipment->useDiscoveryService(discovery);
+        laserEquipment->initializeWithSerialNumber(fSerialNumber, discoveryCache);
 
         if (!laserEquipment->isInitialized()){
             //  try connecting again!
-            laserEquipment->initializeWithSerialNumber(fSerialNumber);
+            laserEquipment->initializeWithSerialNumber(fSerialNumber, discoveryCache);
             //  only if connection fails twice, throw error
             if (!laserEquipment->isInitialized()){
                 fMfe->Msg(MERROR, "Init", "Couldn't find the device. Make sure it is connected and try again.");
@@ -100,6 +115,17 @@ public:
         laserEquipment->setShutterStatus(TopasDevice::BooleanToShutterStatus(shutterStatus));
         laserEquipment->setWavelength(wavelength);  // right now this picks a random interaction! CHANGE later if needed
 
+        //  poll the device in the background, so HandlePeriodic never waits on HTTP
+        //  and only touch the ODB/event buffer when something actually changed
+        laserEquipment->setTelemetryMaxAge(std::chrono::milliseconds(fTelemetryMaxAgeMs));
+        laserEquipment->setWavelengthDeadband(fWavelengthDeadbandNm);
+        laserEquipment->onWavelengthChanged([this](float){ fStateChanged = true; });
+        laserEquipment->onShutterChanged([this](TopasDevice::ShutterStatus){ fStateChanged = true; });
+        laserEquipment->startTelemetry(std::chrono::milliseconds(fTelemetryPeriodMs));
+
+        //  ODB callbacks only queue the new target, so quick successive changes skip the stale ones
+        commandQueue = new TopasCommandQueue(*laserEquipment);
+
         //  register callbacks for each setting change
         char tmpbuf[80];  //  80 bytes long temporary buffer (longer? shorter?)
         HNDLE hkey;
@@ -137,8 +163,21 @@ public:
             return;
         }
 
-        bool currentShutterStatus = TopasDevice::ShutterStatusToBoolean(laserEquipment->getShutterStatus());
-        double currentWavelength = (double) laserEquipment->getCurrentWavelength(); 
+        //  latest sample from the telemetry thread. Shutter and wavelength are read in one concurrent batch,
+        //  so both values belong to the same moment
+        TopasDevice::Snapshot status = laserEquipment->latestSnapshot();
+        if (!status.valid || laserEquipment->telemetryAge() > std::chrono::milliseconds(fTelemetryMaxAgeMs)){
+            //  an open breaker means the device is down and only probed now and then, not a one-off error
+            if (laserEquipment->connectionState() != TopasCircuitBreaker::State::CLOSED) {fEq->SetStatus("Device Unreachable, retrying...", "lightred");}
+            else {fEq->SetStatus("Communication Failure", "lightred");}
+            fCommunicationOk = false;
+            return;
+        }
+        bool changed = fStateChanged.exchange(false);
+        if (fCommunicationOk && !changed) {return;}  //  nothing new since the last tick
+        fCommunicationOk = true;
+        bool currentShutterStatus = TopasDevice::ShutterStatusToBoolean(status.shutterStatus);
+        double currentWavelength = (double) status.wavelength;
 
         // Update MIDAS with shutter status, wavelength, interactions avaiable
         SendEvent(currentShutterStatus, currentWavelength); // save data to MIDAS bank to mid.lz4 file
@@ -168,8 +207,13 @@ void wavelength_callback(INT hDB, INT hkey, INT index, void *feptr)
         return;
     }
 
-    // send the new value to the laser system
-    fe->laserEquipment->setWavelength(wavelength);
+    // queue the new value for the laser system. A target replaced before it started is dropped (CANCELLED)
+    TopasOperation operation = fe->commandQueue->requestWavelength(wavelength);
+    operation.onComplete([wavelength](const TopasOperation::Result& result){
+        if (result.status == TopasOperation::Status::FAILED || result.status == TopasOperation::Status::TIMED_OUT){
+            std::cerr << "[ERROR] Setting wavelength " << wavelength << "nm: " << result.message << std::endl;
+        }
+    });
 
     //  check that wavelength actually changed below? (API should already do that! Can change so it return true/false)
     //  (NOT IMPLEMENTED)
@@ -195,8 +239,13 @@ void shutter_callback(INT hDB, INT hkey, INT index, void *feptr)
         return;
     }
 
-    // send the new value to the laser system
-    fe->laserEquipment->setShutterStatus(TopasDevice::BooleanToShutterStatus(shutterStatusToSet));
+    // queue the new value for the laser system
+    TopasOperation operation = fe->commandQueue->requestShutterStatus(TopasDevice::BooleanToShutterStatus(shutterStatusToSet));
+    operation.onComplete([](const TopasOperation::Result& result){
+        if (result.status == TopasOperation::Status::FAILED || result.status == TopasOperation::Status::TIMED_OUT){
+            std::cerr << "[ERROR] Setting shutter status: " << result.message << std::endl;
+        }
+    });
     //  check that status actually changed below? (API should already do that! Though I can change it so it return true/false)
     //  (NOT IMPLEMENTED)
 
@@ -254,6 +303,11 @@ int main(int argc, char *argv[])
     }
 
     // do cleanup tasks. It seems I get a warning when I try to delete the dynamically allocated memory here (in particular, deleting myfe), but we really do want to make sure picometer gets deleted because the destructor does safety cleanup
+    if (myfe->commandQueue)
+    {
+        delete myfe->commandQueue;
+        myfe->commandQueue = nullptr;
+    }
     if (myfe->laserEquipment)
     {
         delete myfe->laserEquipment;
@@ -0,0 +1,131 @@
+#include "TopasCircuitBreaker.hh"
+#include <map>
+#include <iostream>
+#include <algorithm>
+
+std::string TopasCircuitBreaker::StateToString(State state){
+    switch(state){
+        case(State::CLOSED): return "CLOSED";
+        case(State::OPEN): return "OPEN";
+        case(State::HALF_OPEN): return "HALF_OPEN";
+        default: return "UNKNOWN";
+    }
+}
+
+std::shared_ptr<TopasCircuitBreaker> TopasCircuitBreaker::forAddress(const std::string& baseAddress){
+    static std::mutex registryMutex;
+    static std::map<std::string, std::weak_ptr<TopasCircuitBreaker> > registry;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::shared_ptr<TopasCircuitBreaker> breaker = registry[baseAddress].lock();
+    if(breaker) {return breaker;}
+
+    //  Forget the breakers of addresses nobody uses anymore
+    for(auto it = registry.begin(); it != registry.end();){
+        if(it->second.expired() && it->first != baseAddress) {it = registry.erase(it);}
+        else {++it;}
+    }
+    breaker = std::make_shared<TopasCircuitBreaker>(baseAddress);
+    registry[baseAddress] = breaker;
+    return breaker;
+}
+
+bool TopasCircuitBreaker::isDeviceFailure(CURLcode res, long httpResponseCode){
+    switch(res){
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+            return true;
+        case CURLE_OK:
+            return httpResponseCode == 502 || httpResponseCode == 503 || httpResponseCode == 504;
+        default:
+            return false;
+    }
+}
+
+TopasCircuitBreaker::TopasCircuitBreaker(const std::string& baseAddress) : m_baseAddress{baseAddress}, m_state{State::CLOSED}, m_failures{0}, m_failureThreshold{5}, m_initialProbeDelay{1000}, m_maxProbeDelay{30000}, m_probeDelay{1000} {
+
+}
+
+bool TopasCircuitBreaker::allowRequest(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    switch(m_state){
+        case(State::CLOSED): return true;
+        case(State::HALF_OPEN): return false;  //  only the probe
+        default: break;
+    }
+
+    if(Clock::now() < m_nextProbe) {return false;}
+    m_state = State::HALF_OPEN;  //  this request is the probe
+    return true;
+}
+
+void TopasCircuitBreaker::recordResult(CURLcode res, long httpResponseCode){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(isDeviceFailure(res, httpResponseCode)){
+        ++m_failures;
+        if(m_state == State::HALF_OPEN){
+            m_probeDelay = (std::min)(m_probeDelay * 2, m_maxProbeDelay);
+            m_state = State::OPEN;
+            m_nextProbe = Clock::now() + m_probeDelay;
+        } else if(m_state == State::CLOSED && m_failures >= m_failureThreshold){
+            m_probeDelay = m_initialProbeDelay;
+            m_state = State::OPEN;
+            m_nextProbe = Clock::now() + m_probeDelay;
+            std::cerr << "[WARNING] " << m_baseAddress << " failed " << m_failures << " times in a row, failing requests fast until it answers again" << std::endl;
+        }
+        //  Already open: a late result of a request started before, the probe schedule stays as it is
+        return;
+    }
+
+    //  Neither answered nor a sign of an outage (e.g. the transfer was cancelled here): let the next request probe
+    if(res != CURLE_OK && httpResponseCode == 0){
+        if(m_state == State::HALF_OPEN){
+            m_state = State::OPEN;
+            m_nextProbe = Clock::now();
+        }
+        return;
+    }
+
+    if(m_state != State::CLOSED) {std::cout << "Connection to " << m_baseAddress << " restored after " << m_failures << " failed requests" << std::endl;}
+    m_state = State::CLOSED;
+    m_failures = 0;
+    m_probeDelay = m_initialProbeDelay;
+}
+
+TopasCircuitBreaker::State TopasCircuitBreaker::state() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_state;
+}
+
+int TopasCircuitBreaker::consecutiveFailures() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failures;
+}
+
+std::chrono::milliseconds TopasCircuitBreaker::nextProbeIn() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_state != State::OPEN) {return std::chrono::milliseconds::zero();}
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextProbe - Clock::now());
+    return (std::max)(remaining, std::chrono::milliseconds::zero());
+}
+
+const std::string& TopasCircuitBreaker::baseAddress() const {
+    return m_baseAddress;
+}
+
+void TopasCircuitBreaker::setFailureThreshold(int failures){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_failureThreshold = (std::max)(failures, 1);
+}
+
+void TopasCircuitBreaker::setProbeDelay(std::chrono::milliseconds initial, std::chrono::milliseconds maximum){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_initialProbeDelay = initial;
+    m_maxProbeDelay = (std::max)(initial, maximum);
+    m_probeDelay = (std::min)(m_probeDelay, m_maxProbeDelay);
+}
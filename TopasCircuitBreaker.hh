@@ -0,0 +1,61 @@
+#ifndef TOPASCIRCUITBREAKER_HH
+#define TOPASCIRCUITBREAKER_HH
+
+#include <string>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <curl/curl.h>
+
+//  Stops requests to a device that is not answering. Every request reports its outcome; after failureThreshold
+//  failures in a row the breaker opens and requests fail immediately instead of each waiting out a connection
+//  attempt. Once the probe delay has passed, one request is let through (half open): if the device answers the
+//  breaker closes again, otherwise it stays open and the delay doubles, up to the maximum.
+//  There is one breaker per base address, shared by all communicators talking to it (see forAddress).
+class TopasCircuitBreaker{
+public:
+    enum class State{
+        CLOSED,  //  requests go through
+        OPEN,  //  requests fail fast until the next probe is due
+        HALF_OPEN  //  a probe request is running, the others still fail fast
+    };
+    typedef std::chrono::steady_clock Clock;
+
+    static std::string StateToString(State state);
+
+    //  The breaker of baseAddress, created on first use and kept while anyone holds it
+    static std::shared_ptr<TopasCircuitBreaker> forAddress(const std::string& baseAddress);
+
+    //  Failures that say the device (or the path to it) is down: no connection, timeouts, dropped or empty
+    //  replies and 502/503/504. Anything the device answered otherwise counts as success.
+    static bool isDeviceFailure(CURLcode res, long httpResponseCode);
+
+    explicit TopasCircuitBreaker(const std::string& baseAddress);
+
+    //  Call before a request; false means fail it right away. A true must be followed by recordResult.
+    bool allowRequest();
+    void recordResult(CURLcode res, long httpResponseCode);
+
+    State state() const;
+    int consecutiveFailures() const;
+    //  While open: time until the next probe is let through
+    std::chrono::milliseconds nextProbeIn() const;
+    const std::string& baseAddress() const;
+
+    void setFailureThreshold(int failures);  //  default 5
+    void setProbeDelay(std::chrono::milliseconds initial, std::chrono::milliseconds maximum);  //  default 1 s, 30 s
+
+private:
+    const std::string m_baseAddress;
+    mutable std::mutex m_mutex;
+    State m_state;
+    int m_failures;
+    int m_failureThreshold;
+    std::chrono::milliseconds m_initialProbeDelay;
+    std::chrono::milliseconds m_maxProbeDelay;
+    std::chrono::milliseconds m_probeDelay;
+    Clock::time_point m_nextProbe;
+};
+
+
+#endif
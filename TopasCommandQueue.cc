@@ -0,0 +1,126 @@
+#include "TopasCommandQueue.hh"
+
+TopasCommandQueue::TopasCommandQueue(const TopasDevice& device) : m_device(device), m_stop{false}, m_superseded{0}, m_busy{false} {
+    m_wavelength.pending = false;
+    m_wavelength.wavelength = -1;
+    m_shutter.pending = false;
+    m_shutter.status = TopasDevice::ShutterStatus::CLOSED;
+    m_worker = std::thread(&TopasCommandQueue::run, this);
+}
+
+TopasCommandQueue::~TopasCommandQueue(){
+    TopasOperation inProgress;
+    bool busy;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        busy = m_busy;
+        inProgress = m_inProgress;
+    }
+    m_wake.notify_all();
+    //  Otherwise the worker stays blocked until the command on the device finishes on its own
+    if(busy) {inProgress.cancel();}
+    if(m_worker.joinable()) {m_worker.join();}
+
+    //  Anything still pending never reached the device
+    if(m_wavelength.pending) {m_wavelength.operation.complete(TopasOperation::Status::CANCELLED, "Command queue shut down");}
+    if(m_shutter.pending) {m_shutter.operation.complete(TopasOperation::Status::CANCELLED, "Command queue shut down");}
+}
+
+TopasOperation TopasCommandQueue::requestWavelength(float wavelength){
+    return requestWavelength(wavelength, "");
+}
+
+//  An empty interactionName lets the device's selection policy choose
+TopasOperation TopasCommandQueue::requestWavelength(float wavelength, const std::string& interactionName){
+    TopasOperation operation;
+    TopasOperation superseded;
+    bool hadPending = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_wavelength.pending){
+            superseded = m_wavelength.operation;
+            hadPending = true;
+            ++m_superseded;
+        }
+        m_wavelength.pending = true;
+        m_wavelength.wavelength = wavelength;
+        m_wavelength.interactionName = interactionName;
+        m_wavelength.operation = operation;
+    }
+    m_wake.notify_all();
+    if(hadPending) {superseded.complete(TopasOperation::Status::CANCELLED, "Superseded by a newer wavelength target");}
+    return operation;
+}
+
+TopasOperation TopasCommandQueue::requestShutterStatus(TopasDevice::ShutterStatus status){
+    TopasOperation operation;
+    TopasOperation superseded;
+    bool hadPending = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_shutter.pending){
+            superseded = m_shutter.operation;
+            hadPending = true;
+            ++m_superseded;
+        }
+        m_shutter.pending = true;
+        m_shutter.status = status;
+        m_shutter.operation = operation;
+    }
+    m_wake.notify_all();
+    if(hadPending) {superseded.complete(TopasOperation::Status::CANCELLED, "Superseded by a newer shutter target");}
+    return operation;
+}
+
+size_t TopasCommandQueue::supersededCount() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_superseded;
+}
+
+//  Passes the result of the device operation on to the handle the caller holds. Called and returns with lock held.
+void TopasCommandQueue::forward(const TopasOperation& source, const TopasOperation& target, std::unique_lock<std::mutex>& lock){
+    //  cancelling the queued handle stops the command on the device as well
+    target.setCancelHandler([source]{ source.cancel(); });
+    m_busy = true;
+    m_inProgress = source;
+    bool stop = m_stop;
+    lock.unlock();
+
+    //  Cancelled (or the queue shut down) after the command started but before the handler was in place
+    if(stop || target.isDone()) {source.cancel();}
+    TopasOperation::Result result = source.wait();
+    target.complete(result.status, result.message, result.value);
+
+    lock.lock();
+    m_busy = false;
+    m_inProgress = TopasOperation();
+}
+
+//  Worker thread. Shutter changes are quick, so they go first when both kinds are pending.
+void TopasCommandQueue::run(){
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true){
+        m_wake.wait(lock, [this]{ return m_stop || m_wavelength.pending || m_shutter.pending; });
+        if(m_stop) {return;}
+
+        if(m_shutter.pending){
+            PendingShutter command = m_shutter;
+            m_shutter.pending = false;
+            if(command.operation.isDone()) {continue;}  //  cancelled while it was waiting
+            lock.unlock();
+            TopasOperation toggle = m_device.setShutterStatusAsync(command.status);
+            lock.lock();
+            forward(toggle, command.operation, lock);
+            continue;
+        }
+
+        PendingWavelength command = m_wavelength;
+        m_wavelength.pending = false;
+        if(command.operation.isDone()) {continue;}
+        lock.unlock();
+        TopasOperation move = m_device.setWavelengthAsync(command.wavelength, command.interactionName);
+        lock.lock();
+        forward(move, command.operation, lock);
+    }
+}
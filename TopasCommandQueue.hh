@@ -0,0 +1,55 @@
+#ifndef TOPASCOMMANDQUEUE_HH
+#define TOPASCOMMANDQUEUE_HH
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "TopasDevice.hh"
+
+//  Per-device queue of setpoint changes, executed one at a time on a worker thread.
+//  There is at most one pending target per setpoint kind (wavelength, shutter): a newer request replaces
+//  the pending one (last writer wins) and the replaced operation finishes as CANCELLED without ever
+//  reaching the device. The latest target is applied as soon as the command in progress finishes.
+class TopasCommandQueue{
+public:
+    explicit TopasCommandQueue(const TopasDevice& device);
+    ~TopasCommandQueue();  //  drops pending targets and cancels the command in progress
+
+    TopasOperation requestWavelength(float wavelength);
+    TopasOperation requestWavelength(float wavelength, const std::string& interactionName);
+    TopasOperation requestShutterStatus(TopasDevice::ShutterStatus status);
+
+    //  Number of requests dropped because a newer target of the same kind arrived first
+    size_t supersededCount() const;
+
+private:
+    const TopasDevice& m_device;
+
+    struct PendingWavelength{
+        bool pending;
+        float wavelength;
+        std::string interactionName;
+        TopasOperation operation;
+    };
+    struct PendingShutter{
+        bool pending;
+        TopasDevice::ShutterStatus status;
+        TopasOperation operation;
+    };
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop;
+    PendingWavelength m_wavelength;
+    PendingShutter m_shutter;
+    size_t m_superseded;
+    bool m_busy;  //  m_inProgress is running on the device
+    TopasOperation m_inProgress;
+    std::thread m_worker;
+
+    void run();
+    void forward(const TopasOperation& source, const TopasOperation& target, std::unique_lock<std::mutex>& lock);
+};
+
+
+#endif
@@ -1,41 +1,161 @@
 #include "TopasCommunicator.hh"
+#include "TopasRequestEngine.hh"
+#include <chrono>
+
+//  Callback function for CURL to collect the cache validators from the response headers
+static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    size_t length = size * nitems;
+    TopasCommunicator::CacheValidators* validators = static_cast<TopasCommunicator::CacheValidators*>(userdata);
+    std::string line(buffer, length);
+    size_t colon = line.find(':');
+    if(colon == std::string::npos) {return length;}
+
+    std::string name = line.substr(0, colon);
+    for(auto& c : name) {c = (char)tolower((unsigned char)c);}
+    size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+    size_t valueEnd = line.find_last_not_of(" \t\r\n");
+    if(valueStart == std::string::npos || valueEnd < valueStart) {return length;}
+    std::string value = line.substr(valueStart, valueEnd - valueStart + 1);
+
+    if(name == "etag") {validators->etag = value;}
+    else if(name == "last-modified") {validators->lastModified = value;}
+    return length;
+}
 
-// Callback function for CURL to write response data
-static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s) {
-    size_t newLength = size * nmemb;
-    try {
-        s->append((char*)contents, newLength);
-        return newLength;
-    } catch(std::bad_alloc& e) {
-        // Handle memory problem
-        return 0;
-    }
+//  Same test as checkBaseAddress, but on a handle of its own, so it can run on a thread that outlives the communicator
+static bool probeBaseAddress(const std::string& baseAddress, long connectTimeoutMs){
+    CURL* curl = curl_easy_init();
+    if(!curl) {return false;}
+
+    std::string testURL = baseAddress + "/Optical/WavelengthControl/Output";
+    TopasResponseSink sink;  //  the body is not needed
+    curl_easy_setopt(curl, CURLOPT_URL, testURL.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, TopasResponseSink::write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, connectTimeoutMs + 2000L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connectTimeoutMs);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);  //  4xx/5xx count as failure
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    return res == CURLE_OK;
 }
 
-TopasCommunicator::TopasCommunicator() : m_serialNum{""}, m_baseAddress{""}, m_initialized{false} {
+TopasCommunicator::TopasCommunicator() : m_serialNum{""}, m_initialized{false}, m_baseAddress{""}, m_baseAddressGeneration{0}, m_discoveryCallbackId{0}, m_share{nullptr}, m_jsonHeaders{nullptr}, m_maxResponseSize{DEFAULT_MAX_RESPONSE_SIZE}, m_asyncInFlight{0} {
     //  Initialize CURL for the entire instance (globally)
     if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK){
         printf("Failed to initialize CURL!");
         return;
     }
+
+    //  Share the DNS cache between pooled handles so the host name is only resolved once
+    m_share = curl_share_init();
+    if(m_share){
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &TopasCommunicator::lockShare);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &TopasCommunicator::unlockShare);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+
+    m_jsonHeaders = curl_slist_append(m_jsonHeaders, "Content-Type: application/json");
+    m_jsonHeaders = curl_slist_append(m_jsonHeaders, "Accept: application/json");
 }
 
 TopasCommunicator::~TopasCommunicator(){
+    if(m_discoveryService) {m_discoveryService->removeDeviceEventCallback(m_discoveryCallbackId);}
+
+    //  Async completions still point at this object, so let them finish first
+    {
+        std::unique_lock<std::mutex> lock(m_asyncMutex);
+        m_asyncDone.wait(lock, [this]{ return m_asyncInFlight == 0; });
+    }
+
+    //  Handles must go before the share they point to
+    for(const auto& endpoint : m_pollEndpoints){
+        if(endpoint->curl) {curl_easy_cleanup(endpoint->curl);}
+    }
+    for(CURL* curl : m_idleHandles){
+        curl_easy_cleanup(curl);
+    }
+    m_idleHandles.clear();
+    if(m_share) {curl_share_cleanup(m_share);}
+    curl_slist_free_all(m_jsonHeaders);
+}
+
+void TopasCommunicator::lockShare(CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void* userptr){
+    static_cast<TopasCommunicator*>(userptr)->m_shareLocks[data].lock();
+}
+
+void TopasCommunicator::unlockShare(CURL* /*handle*/, curl_lock_data data, void* userptr){
+    static_cast<TopasCommunicator*>(userptr)->m_shareLocks[data].unlock();
+}
+
+//  Hands out an idle handle from the pool (with its open connection), or a new one if the pool is empty
+CURL* TopasCommunicator::acquireHandle() const {
+    {
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        if(!m_idleHandles.empty()){
+            CURL* curl = m_idleHandles.back();
+            m_idleHandles.pop_back();
+            return curl;
+        }
+    }
+    return curl_easy_init();
+}
+
+//  Returns a handle to the pool. curl_easy_reset clears the options but keeps the live connection and caches.
+void TopasCommunicator::releaseHandle(CURL* curl) const {
+    if(!curl) {return;}
+    curl_easy_reset(curl);
+    {
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        if(m_idleHandles.size() < MAX_IDLE_HANDLES){
+            m_idleHandles.push_back(curl);
+            return;
+        }
+    }
+    curl_easy_cleanup(curl);
+}
 
+//  Sets the options shared by every request. body == nullptr means GET, otherwise method is PUT or POST.
+void TopasCommunicator::prepareHandle(CURL* curl, const char* method, const std::string& fullUrl, const std::string* body, TopasResponseSink* sink) const {
+    curl_easy_setopt(curl, CURLOPT_URL, fullUrl.c_str());  // defines the full URL that we are writing to
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, TopasResponseSink::write);  // defines the write callback function
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, sink);  // defines the pointer that gets passed to the callback function
+    if(sink->maxSize > 0) {curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)sink->maxSize);}  // refuse a too large Content-Length up front
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);  // handles may be used from several threads
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);  // keep the pooled connection open between polls
+    if(m_share) {curl_easy_setopt(curl, CURLOPT_SHARE, m_share);}
+
+    if(body){
+        if(strcmp(method, "POST") == 0) {curl_easy_setopt(curl, CURLOPT_POST, 1L);}
+        else {curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);}
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m_jsonHeaders);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body->size());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->c_str());
+    }
 }
+
 //  Given the serial number of the Topas device, uses the TopasLocator to find matching device
 bool TopasCommunicator::initializeWithSerialNumber(const std::string& serialNum){
-    //  Grab Topas devices using locator, and select the one with correct serialNum
-    std::vector<json> avaiableDevices = m_locator.locate();
-    for(const auto& device : avaiableDevices){
-        if(device["SerialNumber"] == serialNum){
-            m_baseAddress = device["PublicApiRestUrl_Version0"];
-            //m_baseAddress = "http://142.90.111.190:8004/P23894/v0/PublicAPI";  //  hardcoded address of MIEL Topas device.
-            m_serialNum = serialNum;
-            m_initialized = true;
-            std::cout << "Sucessfully initialized device with base address: " << m_baseAddress << std::endl;
-            return true;
-        }
+    //  A running discovery service already knows the address, otherwise ask the locator for this serial number
+    //  only. It returns as soon as the device answers.
+    std::string restUrl;
+    TopasLocator::DeviceRecord record;
+    if(m_discoveryService && m_discoveryService->findBySerial(serialNum, record)){
+        restUrl = record.restUrl;
+    } else {
+        json device = m_locator.locateSerial(serialNum);
+        if(!device.empty() && device.contains("PublicApiRestUrl_Version0")) {restUrl = device["PublicApiRestUrl_Version0"];}
+    }
+
+    if(!restUrl.empty()){
+        setBaseAddress(restUrl);
+        //m_baseAddress = "http://142.90.111.190:8004/P23894/v0/PublicAPI";  //  hardcoded address of MIEL Topas device.
+        m_serialNum = serialNum;
+        m_initialized = true;
+        std::cout << "Sucessfully initialized device with base address: " << restUrl << std::endl;
+        return true;
     }
     //  If no device found, throw a warning
     std::cerr << "[WARNING] Failed to find device with serial number " << serialNum << std::endl;
@@ -45,9 +165,104 @@ bool TopasCommunicator::initializeWithSerialNumber(const std::string& serialNum)
 //  Directly initialize the TopasCommunicator with the given base address. Will check address first to make sure
 //  communication has been established!
 bool TopasCommunicator::initializeWithBaseAddress(const std::string& baseAddress){
+    if(!checkBaseAddress(baseAddress, 3000, true)) {return false;}
+
+    //  Only if all is good execute the lines below
+    std::cout << "Successfully established connection with base address: " << baseAddress << std::endl;
+    setBaseAddress(baseAddress);
+    m_initialized = true;
+    return true;
+}
+
+//  Tries the cached address of serialNum and a fresh discovery at the same time; the first one that reaches
+//  the device wins. Whatever discovery finds is written back to the cache, so a stale entry gets replaced.
+bool TopasCommunicator::initializeWithSerialNumber(const std::string& serialNum, const std::shared_ptr<TopasDiscoveryCache>& cache){
+    if(!cache) {return initializeWithSerialNumber(serialNum);}
+
+    //  A running discovery service already knows the current address; remember it and skip the race
+    TopasLocator::DeviceRecord record;
+    if(m_discoveryService && m_discoveryService->findBySerial(serialNum, record)){
+        cache->store(serialNum, record.restUrl);
+        return initializeWithSerialNumber(serialNum);
+    }
+
+    struct Race{
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool probeDone;
+        bool probeOk;
+        bool discoveryDone;
+        std::string discoveredUrl;
+    };
+    std::shared_ptr<Race> race = std::make_shared<Race>();
+    race->probeDone = false;
+    race->probeOk = false;
+    race->discoveryDone = false;
+
+    std::string cachedUrl;
+    bool haveCached = cache->lookup(serialNum, cachedUrl);
+
+    //  Discovery gets its own locator and thread, so we do not have to wait for it if the cached address works
+    std::thread([race, cache, serialNum]{
+        TopasLocator locator;
+        locator.setCache(cache);
+        json device = locator.locateSerial(serialNum);
+        std::lock_guard<std::mutex> lock(race->mutex);
+        if(!device.empty() && device.contains("PublicApiRestUrl_Version0")) {race->discoveredUrl = device["PublicApiRestUrl_Version0"];}
+        race->discoveryDone = true;
+        race->changed.notify_all();
+    }).detach();
+
+    //  The probe is detached as well: when discovery wins, we must not wait for a dead cached address to time out
+    if(haveCached){
+        std::thread([race, cachedUrl]{
+            bool ok = probeBaseAddress(cachedUrl, 1000);
+            std::lock_guard<std::mutex> lock(race->mutex);
+            race->probeOk = ok;
+            race->probeDone = true;
+            race->changed.notify_all();
+        }).detach();
+    } else {
+        race->probeDone = true;
+    }
+
+    std::string winner;
+    bool cachedWon = false;
+    {
+        std::unique_lock<std::mutex> lock(race->mutex);
+        race->changed.wait(lock, [&race, &cachedUrl]{
+            bool discoveredElsewhere = race->discoveryDone && !race->discoveredUrl.empty() && race->discoveredUrl != cachedUrl;
+            return race->probeOk || discoveredElsewhere || (race->probeDone && race->discoveryDone);
+        });
+        cachedWon = race->probeOk;
+        if(cachedWon) {winner = cachedUrl;}
+        else if(!race->discoveredUrl.empty()) {winner = race->discoveredUrl;}
+    }
+
+    if(winner.empty()){
+        std::cerr << "[WARNING] Failed to find device with serial number " << serialNum << std::endl;
+        return false;
+    }
+    if(cachedWon){
+        std::cout << "Connected to cached base address: " << winner << std::endl;
+        setBaseAddress(winner);
+        m_serialNum = serialNum;
+        m_initialized = true;
+        return true;
+    }
+
+    //  The cached address is stale, missing or did not answer; the discovery thread has already updated the cache
+    if(!initializeWithBaseAddress(winner)) {return false;}
+    m_serialNum = serialNum;
+    return true;
+}
+
+//  Sends one GET to a status endpoint under baseAddress and reports whether the REST server answered properly.
+//  The pooled handle keeps the connection, so it is already warm for the first real request.
+bool TopasCommunicator::checkBaseAddress(const std::string& baseAddress, long connectTimeoutMs, bool verbose) const {
     //  Check the address to see if communication can be established
-    //  To start, initialize CURL session and check for errors
-    CURL* curl = curl_easy_init();
+    //  To start, grab a pooled CURL handle and check for errors
+    CURL* curl = acquireHandle();
     if(!curl){
         std::cerr << "Failed to start CURL session!" << std::endl;
         return false;
@@ -56,12 +271,11 @@ bool TopasCommunicator::initializeWithBaseAddress(const std::string& baseAddress
     //  Set options for a GET request
     std::string testURL = baseAddress + "/Optical/WavelengthControl/Output";  //  send this request to shutter URL, just to test connection
     std::string response;
+    TopasResponseSink sink(&response, maxResponseSize());
     
-    curl_easy_setopt(curl, CURLOPT_URL, testURL.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 3L);
+    prepareHandle(curl, "GET", testURL, nullptr, &sink);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, connectTimeoutMs + 2000L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connectTimeoutMs);
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 
     //  Perform the HEAD request!
@@ -71,29 +285,24 @@ bool TopasCommunicator::initializeWithBaseAddress(const std::string& baseAddress
     long httpResponseCode = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
 
-    //  Clean up
-    curl_easy_cleanup(curl);
+    //  Return the handle (and its open connection) to the pool
+    releaseHandle(curl);
 
     //  Check if connection was successful
     if(res != CURLE_OK){
-        std::cerr << "[ERROR] Failed to connect to base address: " << baseAddress << std::endl;
-        std::cerr << "[ERROR] Received CURL error: " << curl_easy_strerror(res) << std::endl;
+        if(verbose){
+            std::cerr << "[ERROR] Failed to connect to base address: " << baseAddress << std::endl;
+            std::cerr << "[ERROR] Received CURL error: " << curl_easy_strerror(res) << std::endl;
+        }
         return false;
     }
 
     //  If HTTP response code is >= 400 most likely something is still wrong... 4xx codes are Client errors!
     if(httpResponseCode >= 400){
-        std::cerr << "[ERROR] HTTP response code " << httpResponseCode << " corresponds to client error" << std::endl;
+        if(verbose) {std::cerr << "[ERROR] HTTP response code " << httpResponseCode << " corresponds to client error" << std::endl;}
         return false;
     }
-
-    //  Only if all is good execute the lines below
-    std::cout << "Successfully established connection with base address: " << baseAddress << std::endl;
-    m_baseAddress = baseAddress;
-    m_initialized = true;
     return true;
-
-
 }
 
 
@@ -102,94 +311,392 @@ bool TopasCommunicator::isInitialized() const {
 }
 
 std::string TopasCommunicator::baseAddress() const {
+    std::lock_guard<std::mutex> lock(m_baseAddressMutex);
     return m_baseAddress;
 }
 
+void TopasCommunicator::setBaseAddress(const std::string& baseAddressToSet){
+    std::shared_ptr<TopasCircuitBreaker> breaker = TopasCircuitBreaker::forAddress(baseAddressToSet);
+    std::lock_guard<std::mutex> lock(m_baseAddressMutex);
+    m_baseAddress = baseAddressToSet;
+    m_circuitBreaker = breaker;
+    ++m_baseAddressGeneration;
+}
+
+std::shared_ptr<TopasCircuitBreaker> TopasCommunicator::circuitBreaker() const {
+    std::lock_guard<std::mutex> lock(m_baseAddressMutex);
+    return m_circuitBreaker;
+}
+
+void TopasCommunicator::useDiscoveryService(const std::shared_ptr<TopasLocator>& service){
+    if(m_discoveryService) {m_discoveryService->removeDeviceEventCallback(m_discoveryCallbackId);}
+    m_discoveryService = service;
+    if(!m_discoveryService) {return;}
+
+    //  Follow our device if it restarts under a new URL (e.g. a different port)
+    m_discoveryCallbackId = m_discoveryService->onDeviceEvent([this](TopasLocator::DeviceEvent event, const TopasLocator::DeviceRecord& device){
+        if(event != TopasLocator::DeviceEvent::URL_CHANGED || m_serialNum.empty() || device.serialNumber != m_serialNum) {return;}
+        std::cout << "Device " << m_serialNum << " moved to base address: " << device.restUrl << std::endl;
+        setBaseAddress(device.restUrl);
+    });
+}
+
 json TopasCommunicator::get(const std::string& url) const {
+    return performRequest("GET", url, nullptr, requestPolicy());
+}
+
+json TopasCommunicator::put(const std::string& url, const json& data) const {
+    return performRequest("PUT", url, &data, requestPolicy());
+}
+
+json TopasCommunicator::post(const std::string& url, const json& data) const {
+    return performRequest("POST", url, &data, requestPolicy());
+}
+
+json TopasCommunicator::get(const std::string& url, const TopasRequestPolicy& policy) const {
+    return performRequest("GET", url, nullptr, policy);
+}
+
+json TopasCommunicator::put(const std::string& url, const json& data, const TopasRequestPolicy& policy) const {
+    return performRequest("PUT", url, &data, policy);
+}
+
+json TopasCommunicator::post(const std::string& url, const json& data, const TopasRequestPolicy& policy) const {
+    return performRequest("POST", url, &data, policy);
+}
+
+void TopasCommunicator::setRequestPolicy(const TopasRequestPolicy& policy){
+    std::lock_guard<std::mutex> lock(m_policyMutex);
+    m_requestPolicy = policy;
+}
+
+TopasRequestPolicy TopasCommunicator::requestPolicy() const {
+    std::lock_guard<std::mutex> lock(m_policyMutex);
+    return m_requestPolicy;
+}
+
+json TopasCommunicator::performRequest(const char* method, const std::string& url, const json* data, const TopasRequestPolicy& policy) const {
     //  Check if device is properly initialized
     if (!m_initialized){
         std::cerr << "[ERROR] Device not initialized!" << std::endl;
         return json();
     }
 
-    std::string fullUrl = m_baseAddress + url;
-    std::string response;
-
-    //  Initialize CURL session and check for errors
-    CURL* curl = curl_easy_init();
+    //  Grab a handle (and its open connection) from the pool and check for errors
+    CURL* curl = acquireHandle();
     if(!curl){
         std::cerr << "Failed to start CURL session!" << std::endl;
         return json();
     }
 
-    //  Set CURL options
-    curl_easy_setopt(curl, CURLOPT_URL, fullUrl.c_str());  // defines the full URL that we are writing to
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);  // defines the write callback function
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);  // defines the pointer that gets passed to the callback function
+    std::string fullUrl = baseAddress() + url;
+    std::string response;
+    std::string jsonStr;
+    if(data) {jsonStr = data->dump();}
 
-    CURLcode res = curl_easy_perform(curl);  // executes our request
-    if(res!=CURLE_OK){
-        std::cerr << "Failed to perform GET request!\nCURL error: " << curl_easy_strerror(res) << std::endl;
-        curl_easy_cleanup(curl);
-        return json();
+    TopasResponseSink sink(&response, maxResponseSize());
+    prepareHandle(curl, method, fullUrl, data ? &jsonStr : nullptr, &sink);
+
+    //  Send the request!
+    std::shared_ptr<TopasCircuitBreaker> breaker = circuitBreaker();
+    CURLcode res = performTransfer(curl, method, fullUrl, policy, sink, breaker.get());
+    releaseHandle(curl);
+    return parseResponse(method, res, response);
+}
+
+//  Runs the prepared transfer on curl until it succeeds, fails for good, runs out of retries or hits the total
+//  deadline of policy. The sink is emptied before every attempt, so it only holds the body of the last one.
+//  Every attempt is reported to breaker (if any); while it is open the transfer fails with CURLE_COULDNT_CONNECT
+//  without trying.
+CURLcode TopasCommunicator::performTransfer(CURL* curl, const char* method, const std::string& fullUrl, const TopasRequestPolicy& policy, TopasResponseSink& sink, TopasCircuitBreaker* breaker) const {
+    auto start = TopasRequestPolicy::Clock::now();
+    for(int retry = 0; ; ++retry){
+        long remaining = policy.remainingMs(start);
+        if(remaining < 0) {return CURLE_OPERATION_TIMEDOUT;}
+        if(breaker && !breaker->allowRequest()) {return CURLE_COULDNT_CONNECT;}
+        policy.applyTimeouts(curl, remaining);
+        sink.reset();
+
+        CURLcode res = curl_easy_perform(curl);
+        long httpResponseCode = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+        if(breaker) {breaker->recordResult(res, httpResponseCode);}
+        if(!policy.shouldRetry(method, res, httpResponseCode, retry)) {return res;}
+        if(breaker && breaker->state() != TopasCircuitBreaker::State::CLOSED) {return res;}  //  the device is down, do not wait for it
+
+        //  Give up now if the wait alone would use up what is left of the deadline
+        long backoff = policy.backoffMs(retry);
+        remaining = policy.remainingMs(start);
+        if(remaining < 0 || (remaining > 0 && backoff >= remaining)) {return res;}
+
+        std::cerr << "[WARNING] " << method << " " << fullUrl << " failed (";
+        if(res != CURLE_OK) {std::cerr << curl_easy_strerror(res);}
+        else {std::cerr << "HTTP " << httpResponseCode;}
+        std::cerr << "), retrying in " << backoff << " ms" << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
     }
-    curl_easy_cleanup(curl);
+}
 
-    // Return an empty JSON object if no response
-    if (response.empty()) {
-        return json::object();
+//  Prints why a request failed. Requests turned away by an open circuit breaker stay quiet, the breaker has
+//  already reported the outage (and will report the recovery).
+void TopasCommunicator::reportFailure(const char* method, CURLcode res) const {
+    if(res == CURLE_COULDNT_CONNECT){
+        std::shared_ptr<TopasCircuitBreaker> breaker = circuitBreaker();
+        if(breaker && breaker->state() != TopasCircuitBreaker::State::CLOSED) {return;}
     }
+    std::cerr << "Failed to perform " << method << " request!\nCURL error: " << curl_easy_strerror(res) << std::endl;
+}
 
-    //  Parse the JSON response
-    try{
-        return json::parse(response);
-    } catch(const std::exception& e){
-        std::cerr << "Failed to parse JSON response. Error: " << e.what() << std::endl;
+int TopasCommunicator::addPollEndpoint(const std::string& url){
+    std::unique_ptr<PollEndpoint> endpoint(new PollEndpoint());
+    endpoint->url = url;
+    endpoint->generation = 0;
+    endpoint->curl = nullptr;
+    endpoint->response.reserve(POLL_BUFFER_SIZE);
+
+    std::lock_guard<std::mutex> lock(m_pollEndpointsMutex);
+    m_pollEndpoints.push_back(std::move(endpoint));
+    return (int)m_pollEndpoints.size() - 1;
+}
+
+TopasCommunicator::PollEndpoint* TopasCommunicator::pollEndpoint(int endpoint) const {
+    std::lock_guard<std::mutex> lock(m_pollEndpointsMutex);
+    if(endpoint < 0 || endpoint >= (int)m_pollEndpoints.size()) {return nullptr;}
+    return m_pollEndpoints[endpoint].get();
+}
+
+//  The endpoint keeps its handle configured between polls, so a poll is just the transfer. The URL (and with it
+//  the handle) is only set up again after the base address changed.
+bool TopasCommunicator::performPoll(PollEndpoint& endpoint) const {
+    if (!m_initialized){
+        std::cerr << "[ERROR] Device not initialized!" << std::endl;
+        return false;
+    }
+
+    bool urlChanged = false;
+    {
+        std::lock_guard<std::mutex> lock(m_baseAddressMutex);
+        if(endpoint.fullUrl.empty() || endpoint.generation != m_baseAddressGeneration){
+            endpoint.fullUrl = m_baseAddress + endpoint.url;
+            endpoint.generation = m_baseAddressGeneration;
+            endpoint.breaker = m_circuitBreaker;
+            urlChanged = true;
+        }
+    }
+
+    if(!endpoint.curl){
+        endpoint.curl = acquireHandle();
+        if(!endpoint.curl){
+            std::cerr << "Failed to start CURL session!" << std::endl;
+            return false;
+        }
+        urlChanged = true;
+    }
+    endpoint.sink = TopasResponseSink(&endpoint.response, maxResponseSize());
+    if(urlChanged) {prepareHandle(endpoint.curl, "GET", endpoint.fullUrl, nullptr, &endpoint.sink);}
+
+    CURLcode res = performTransfer(endpoint.curl, "GET", endpoint.fullUrl, requestPolicy(), endpoint.sink, endpoint.breaker.get());  //  the sink clear()s the response, which keeps its capacity
+    if(res != CURLE_OK){
+        reportFailure("GET", res);
+        return false;
+    }
+    return true;
+}
+
+json TopasCommunicator::getConditional(const std::string& url, CacheValidators& validators, bool& notModified) const {
+    notModified = false;
+    CacheValidators received;
+
+    //  Only send the validators the server gave us last time
+    struct curl_slist* headers = nullptr;
+    if(!validators.etag.empty()) {headers = curl_slist_append(headers, ("If-None-Match: " + validators.etag).c_str());}
+    if(!validators.lastModified.empty()) {headers = curl_slist_append(headers, ("If-Modified-Since: " + validators.lastModified).c_str());}
+
+    //  The documents fetched this way (e.g. ExpandedInteractions) are the large ones, so parse them as they arrive
+    CURLcode res;
+    long httpResponseCode = 0;
+    json parsed = performStreamedGet(url, headers, &received, res, httpResponseCode);
+    curl_slist_free_all(headers);
+
+    //  304 Not Modified: the caller's copy is still current
+    if(res == CURLE_OK && httpResponseCode == 304){
+        notModified = true;
         return json();
     }
+
+    if(res == CURLE_OK && httpResponseCode < 400){
+        validators = received;
+    }
+    return parsed;
 }
 
-json TopasCommunicator::put(const std::string& url, const json& data) const {
-    //  Check if device is properly initialized
+bool TopasCommunicator::getConditional(const std::string& url, CacheValidators& validators, bool& notModified, std::string& body) const {
+    notModified = false;
+    body.clear();
     if (!m_initialized){
-        std::cerr << "Error: Device not initialized!" << std::endl;
-        return json();
+        std::cerr << "[ERROR] Device not initialized!" << std::endl;
+        return false;
     }
 
-    //  Initialize CURL session and check for errors
-    CURL* curl = curl_easy_init();
+    CURL* curl = acquireHandle();
     if(!curl){
         std::cerr << "Failed to start CURL session!" << std::endl;
+        return false;
+    }
+
+    struct curl_slist* headers = nullptr;
+    if(!validators.etag.empty()) {headers = curl_slist_append(headers, ("If-None-Match: " + validators.etag).c_str());}
+    if(!validators.lastModified.empty()) {headers = curl_slist_append(headers, ("If-Modified-Since: " + validators.lastModified).c_str());}
+
+    CacheValidators received;
+    std::string fullUrl = baseAddress() + url;
+    TopasResponseSink sink(&body, maxResponseSize());
+    prepareHandle(curl, "GET", fullUrl, nullptr, &sink);
+    if(headers) {curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);}
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &received);
+    std::shared_ptr<TopasCircuitBreaker> breaker = circuitBreaker();
+    CURLcode res = performTransfer(curl, "GET", fullUrl, requestPolicy(), sink, breaker.get());
+    long httpResponseCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+    releaseHandle(curl);
+    curl_slist_free_all(headers);
+
+    if(res != CURLE_OK){
+        reportFailure("GET", res);
+        body.clear();
+        return false;
+    }
+    //  304 Not Modified: the caller's copy is still current
+    if(httpResponseCode == 304){
+        notModified = true;
+        body.clear();
+        return true;
+    }
+    if(httpResponseCode < 200 || httpResponseCode >= 300){
+        std::cerr << "[ERROR] GET " << url << " failed with HTTP response code " << httpResponseCode << std::endl;
+        body.clear();
+        return false;
+    }
+    validators = received;
+    return true;
+}
+
+json TopasCommunicator::getStreamed(const std::string& url) const {
+    CURLcode res;
+    long httpResponseCode = 0;
+    return performStreamedGet(url, nullptr, nullptr, res, httpResponseCode);
+}
+
+void TopasCommunicator::setMaxResponseSize(size_t bytes){
+    m_maxResponseSize = bytes;
+}
+
+size_t TopasCommunicator::maxResponseSize() const {
+    return m_maxResponseSize;
+}
+
+//  Runs the GET on the request engine and parses the body on this thread as it comes in (see TopasResponseStream).
+//  headers and received (response header validators) are optional. Returns the document, an empty object for an
+//  empty body, or null json on failure, on a response that is not 2xx and on one larger than maxResponseSize().
+json TopasCommunicator::performStreamedGet(const std::string& url, struct curl_slist* headers, CacheValidators* received, CURLcode& res, long& httpResponseCode) const {
+    res = CURLE_FAILED_INIT;
+    httpResponseCode = 0;
+    if (!m_initialized){
+        std::cerr << "[ERROR] Device not initialized!" << std::endl;
         return json();
     }
 
-    std::string fullUrl = m_baseAddress + url;
-    std::string response;
-    std::string jsonStr = data.dump();
+    struct StreamedTransfer{
+        CURL* curl;
+        TopasResponseStream stream;
+        TopasResponseSink sink;
+        long httpResponseCode;
+        std::promise<CURLcode> done;
+    };
+    std::shared_ptr<StreamedTransfer> transfer = std::make_shared<StreamedTransfer>();
+    std::future<CURLcode> done = transfer->done.get_future();
+    transfer->httpResponseCode = 0;
+
+    transfer->curl = acquireHandle();
+    if(!transfer->curl){
+        std::cerr << "Failed to start CURL session!" << std::endl;
+        return json();
+    }
 
-    //  Set up headers and set CURL options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, "Accept: application/json");
+    transfer->sink = TopasResponseSink(&transfer->stream, maxResponseSize());
+    prepareHandle(transfer->curl, "GET", baseAddress() + url, nullptr, &transfer->sink);
+    TopasRequestPolicy policy = requestPolicy();
+    policy.applyTimeouts(transfer->curl, policy.totalTimeoutMs);
+    if(headers) {curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, headers);}
+    if(received){
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA, received);
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, fullUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    bool submitted = submitAsync(transfer->curl, [this, transfer](CURLcode result){
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &transfer->httpResponseCode);
+        releaseHandle(transfer->curl);
+        transfer->stream.finish();
+        transfer->done.set_value(result);
+    });
+    if(!submitted){
+        std::cerr << "[ERROR] Failed to submit streamed GET request!" << std::endl;
+        releaseHandle(transfer->curl);
+        return json();
+    }
 
-    //  Send the request!
-    CURLcode res = curl_easy_perform(curl);
+    //  A parse error abandons the stream, which makes the write callback stop the transfer
+    json parsed;
+    bool empty = false;
+    std::string parseError;
+    {
+        std::istream input(&transfer->stream);
+        if(input.peek() == std::char_traits<char>::eof()){
+            empty = true;
+        } else {
+            try{
+                parsed = json::parse(input);
+            } catch(const std::exception& e){
+                parseError = e.what();
+                parsed = json();
+                transfer->stream.abandon();
+            }
+        }
+    }
+
+    //  headers/received are used by the transfer until it is done, so always wait for it
+    res = done.get();
+    httpResponseCode = transfer->httpResponseCode;
+
+    //  Either CURL saw the announced length or the sink counted the bytes past the limit
+    if(res == CURLE_FILESIZE_EXCEEDED || transfer->sink.overflowed){
+        std::cerr << "[ERROR] GET " << url << " was aborted at the response size limit of " << transfer->sink.maxSize << " bytes" << std::endl;
+        return json();
+    }
+    //  An error body is not the document that was asked for (the conditional GET handles 304 itself)
+    bool answered = res == CURLE_OK || (res == CURLE_WRITE_ERROR && httpResponseCode != 0);
+    if(answered && (httpResponseCode < 200 || httpResponseCode >= 300)){
+        if(httpResponseCode != 304) {std::cerr << "[ERROR] GET " << url << " failed with HTTP response code " << httpResponseCode << std::endl;}
+        return json();
+    }
+    if(!parseError.empty() && (res == CURLE_OK || res == CURLE_WRITE_ERROR)){
+        std::cerr << "Failed to parse JSON response. Error: " << parseError << std::endl;
+        return json();
+    }
+    if(res != CURLE_OK){
+        reportFailure("GET", res);
+        return json();
+    }
+    return empty ? json::object() : parsed;
+}
+
+//  Common tail of the sync and async paths: report transfer errors and turn the body into JSON
+json TopasCommunicator::parseResponse(const char* method, CURLcode res, const std::string& response) const {
     if(res!=CURLE_OK){
-        std::cerr << "Failed to perform PUT request!\nCURL error: " << curl_easy_strerror(res) << std::endl;
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+        reportFailure(method, res);
         return json();
     }
-    //Clean up
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
 
     // Return an empty JSON object if no response
     if (response.empty()) {
@@ -205,60 +712,160 @@ json TopasCommunicator::put(const std::string& url, const json& data) const {
     }
 }
 
-json TopasCommunicator::post(const std::string& url, const json& data) const {
+std::future<json> TopasCommunicator::getAsync(const std::string& url, const ResponseCallback& onComplete) const {
+    return performRequestAsync("GET", url, nullptr, onComplete);
+}
+
+std::future<json> TopasCommunicator::putAsync(const std::string& url, const json& data, const ResponseCallback& onComplete) const {
+    return performRequestAsync("PUT", url, &data, onComplete);
+}
+
+std::future<json> TopasCommunicator::postAsync(const std::string& url, const json& data, const ResponseCallback& onComplete) const {
+    return performRequestAsync("POST", url, &data, onComplete);
+}
+
+namespace {
+    //  Everything an in-flight async request needs to stay alive until the engine is done with it
+    struct AsyncTransfer{
+        CURL* curl;
+        const char* method;
+        std::string body;
+        std::string response;
+        TopasResponseSink sink;
+        std::promise<json> promise;
+        TopasCommunicator::ResponseCallback onComplete;
+    };
+
+    void completeAsyncTransfer(AsyncTransfer& transfer, const json& result){
+        if(transfer.onComplete){
+            try{
+                transfer.onComplete(result);
+            } catch(const std::exception& e){
+                std::cerr << "[WARNING] Exception in " << transfer.method << " completion callback: " << e.what() << std::endl;
+            }
+        }
+        transfer.promise.set_value(result);
+    }
+}
+
+std::future<json> TopasCommunicator::performRequestAsync(const char* method, const std::string& url, const json* data, const ResponseCallback& onComplete) const {
+    std::shared_ptr<AsyncTransfer> transfer = std::make_shared<AsyncTransfer>();
+    transfer->curl = nullptr;
+    transfer->method = method;
+    transfer->onComplete = onComplete;
+    std::future<json> result = transfer->promise.get_future();
+
     //  Check if device is properly initialized
     if (!m_initialized){
-        std::cerr << "Error: Device not initialized!" << std::endl;
-        return json();
+        std::cerr << "[ERROR] Device not initialized!" << std::endl;
+        completeAsyncTransfer(*transfer, json());
+        return result;
     }
 
-    //  Initialize CURL session and check for errors
-    CURL* curl = curl_easy_init();
-    if(!curl){
+    transfer->curl = acquireHandle();
+    if(!transfer->curl){
         std::cerr << "Failed to start CURL session!" << std::endl;
-        return json();
+        completeAsyncTransfer(*transfer, json());
+        return result;
     }
 
-    std::string fullUrl = m_baseAddress + url;
-    std::string response;
-    std::string jsonStr = data.dump();
+    if(data) {transfer->body = data->dump();}
+    transfer->sink = TopasResponseSink(&transfer->response, maxResponseSize());
+    prepareHandle(transfer->curl, method, baseAddress() + url, data ? &transfer->body : nullptr, &transfer->sink);
+    TopasRequestPolicy policy = requestPolicy();
+    policy.applyTimeouts(transfer->curl, policy.totalTimeoutMs);  //  deadline only, see setRequestPolicy
+
+    bool submitted = submitAsync(transfer->curl, [this, transfer](CURLcode res){
+        json parsed = parseResponse(transfer->method, res, transfer->response);
+        releaseHandle(transfer->curl);
+        completeAsyncTransfer(*transfer, parsed);
+    });
+
+    if(!submitted){
+        std::cerr << "[ERROR] Failed to submit async " << method << " request!" << std::endl;
+        releaseHandle(transfer->curl);
+        completeAsyncTransfer(*transfer, json());
+    }
+    return result;
+}
 
-    //  Set up headers and set CURL options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, "Accept: application/json");
+std::future<std::string> TopasCommunicator::getRawAsync(const std::string& url) const {
+    struct RawTransfer{
+        CURL* curl;
+        std::string response;
+        TopasResponseSink sink;
+        std::promise<std::string> promise;
+    };
+    std::shared_ptr<RawTransfer> transfer = std::make_shared<RawTransfer>();
+    std::future<std::string> result = transfer->promise.get_future();
 
-    curl_easy_setopt(curl, CURLOPT_URL, fullUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    if (!m_initialized){
+        std::cerr << "[ERROR] Device not initialized!" << std::endl;
+        transfer->promise.set_value(std::string());
+        return result;
+    }
 
+    transfer->curl = acquireHandle();
+    if(!transfer->curl){
+        std::cerr << "Failed to start CURL session!" << std::endl;
+        transfer->promise.set_value(std::string());
+        return result;
+    }
 
+    transfer->sink = TopasResponseSink(&transfer->response, maxResponseSize());
+    prepareHandle(transfer->curl, "GET", baseAddress() + url, nullptr, &transfer->sink);
+    TopasRequestPolicy policy = requestPolicy();
+    policy.applyTimeouts(transfer->curl, policy.totalTimeoutMs);
+    bool submitted = submitAsync(transfer->curl, [this, transfer](CURLcode res){
+        releaseHandle(transfer->curl);
+        if(res != CURLE_OK){
+            reportFailure("GET", res);
+            transfer->response.clear();
+        }
+        transfer->promise.set_value(std::move(transfer->response));
+    });
 
-    //  Send the request!
-    CURLcode res = curl_easy_perform(curl);
-    if(res!=CURLE_OK){
-        std::cerr << "Failed to perform POST request!\nCURL error: " << curl_easy_strerror(res) << std::endl;
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        return json();
+    if(!submitted){
+        std::cerr << "[ERROR] Failed to submit async GET request!" << std::endl;
+        releaseHandle(transfer->curl);
+        transfer->promise.set_value(std::string());
     }
-    //Clean up
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    return result;
+}
 
-    // Return an empty JSON object if no response
-    if (response.empty()) {
-        return json::object();
+//  Hands curl to the request engine and counts it as in flight until onDone has run, so the destructor can wait for it.
+//  Returns false (nothing counted, onDone never called) if the engine did not take the transfer.
+//  While the circuit breaker is open the transfer is not started at all: onDone gets CURLE_COULDNT_CONNECT right
+//  away, on this thread.
+bool TopasCommunicator::submitAsync(CURL* curl, const std::function<void(CURLcode)>& onDone) const {
+    std::shared_ptr<TopasCircuitBreaker> breaker = circuitBreaker();
+    if(breaker && !breaker->allowRequest()){
+        onDone(CURLE_COULDNT_CONNECT);
+        return true;
     }
 
-    //  Parse the JSON response
-    try{
-        return json::parse(response);
-    } catch(const std::exception& e){
-        std::cerr << "Failed to parse JSON response. Error: " << e.what() << std::endl;
-        return json();
+    {
+        std::lock_guard<std::mutex> lock(m_asyncMutex);
+        ++m_asyncInFlight;
     }
-}
\ No newline at end of file
+
+    bool submitted = TopasRequestEngine::instance().submit(curl, [this, onDone, breaker, curl](CURLcode res){
+        if(breaker){
+            long httpResponseCode = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+            breaker->recordResult(res, httpResponseCode);
+        }
+        onDone(res);
+        std::lock_guard<std::mutex> lock(m_asyncMutex);
+        --m_asyncInFlight;
+        m_asyncDone.notify_all();
+    });
+
+    if(!submitted){
+        if(breaker) {breaker->recordResult(CURLE_FAILED_INIT, 0);}  //  frees the probe slot if this was the probe
+        std::lock_guard<std::mutex> lock(m_asyncMutex);
+        --m_asyncInFlight;
+        m_asyncDone.notify_all();
+    }
+    return submitted;
+}
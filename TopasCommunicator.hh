@@ -2,32 +2,175 @@
 #define TOPASCOMMUNICATOR_HH
 
 #include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <memory>
 #include <curl/curl.h>
 #include "TopasLocator.hh"
+#include "TopasDiscoveryCache.hh"
+#include "TopasResponseStream.hh"
+#include "TopasRequestPolicy.hh"
+#include "TopasCircuitBreaker.hh"
 
 class TopasCommunicator{
 public:
+    //  Completion callback for the async requests. Runs on the request engine thread, so keep it short.
+    //  (A request turned away by the open circuit breaker completes right away on the calling thread.)
+    typedef std::function<void(const json&)> ResponseCallback;
+
+    //  Validators remembered from a previous response (ETag / Last-Modified headers), used for conditional GETs
+    struct CacheValidators{
+        std::string etag;
+        std::string lastModified;
+    };
+
     TopasCommunicator(const std::string& serialNum);
     TopasCommunicator();
     ~TopasCommunicator();
 
     bool initializeWithSerialNumber(const std::string& serialNum);
     bool initializeWithBaseAddress(const std::string& baseAddress);
+    //  Fast cold start: connects to the address cached for serialNum while discovery runs in parallel
+    bool initializeWithSerialNumber(const std::string& serialNum, const std::shared_ptr<TopasDiscoveryCache>& cache);
 
     json get(const std::string& url) const;
     json put(const std::string& url, const json& data) const;
     json post(const std::string& url, const json& data) const;
+    //  Same with their own deadlines/retries instead of the communicator's policy, e.g. to let a PUT that is
+    //  safe to repeat be retried
+    json get(const std::string& url, const TopasRequestPolicy& policy) const;
+    json put(const std::string& url, const json& data, const TopasRequestPolicy& policy) const;
+    json post(const std::string& url, const json& data, const TopasRequestPolicy& policy) const;
+
+    //  Deadlines and retries of every request (see TopasRequestPolicy). The async and streamed requests only use
+    //  the deadlines: they are not repeated, as the engine can not wait out a backoff and a streamed body is
+    //  already being parsed.
+    void setRequestPolicy(const TopasRequestPolicy& policy);
+    TopasRequestPolicy requestPolicy() const;
+
+    //  Streaming GET: the transfer runs on the request engine while this thread parses the body as it arrives, so
+    //  parsing overlaps the download and the body is never held as one string. Meant for large documents.
+    //  Returns null json for non-2xx responses and for bodies larger than maxResponseSize().
+    json getStreamed(const std::string& url) const;
+
+    //  Responses larger than this are aborted as soon as they cross it (0 = no limit). Defaults to 8 MiB.
+    void setMaxResponseSize(size_t bytes);
+    size_t maxResponseSize() const;
+
+    //  Steady-state polling of a fixed GET endpoint. addPollEndpoint builds the full URL once (again only when the
+    //  base address changes) and gives the endpoint its own CURL handle and response buffer, both reused by every
+    //  poll. poll() performs the request and calls decode(const char* data, size_t length) -> bool on the buffer, so
+    //  after the first few polls neither side allocates. Polls of the same endpoint are serialized.
+    int addPollEndpoint(const std::string& url);
+    template<typename Decoder>
+    bool poll(int endpoint, Decoder decode) const;
+
+    //  GET that sends If-None-Match/If-Modified-Since from validators. On a 304 notModified is set and an
+    //  empty json is returned; otherwise validators are updated from the new response headers.
+    json getConditional(const std::string& url, CacheValidators& validators, bool& notModified) const;
+    //  Same, but hands back the raw body for the typed decoders in TopasResponseDecoder instead of a json DOM.
+    //  Returns false if the transfer failed or the response is not 2xx/304; body is only filled for a 2xx.
+    bool getConditional(const std::string& url, CacheValidators& validators, bool& notModified, std::string& body) const;
+
+    //  Non-blocking versions of get/put/post. All transfers are driven by the shared TopasRequestEngine,
+    //  so many requests (across devices) can be in flight at once. The communicator waits for its
+    //  outstanding async requests before it is destroyed.
+    std::future<json> getAsync(const std::string& url, const ResponseCallback& onComplete = ResponseCallback()) const;
+    std::future<json> putAsync(const std::string& url, const json& data, const ResponseCallback& onComplete = ResponseCallback()) const;
+    std::future<json> postAsync(const std::string& url, const json& data, const ResponseCallback& onComplete = ResponseCallback()) const;
+    //  GET that hands back the raw body instead of a json DOM, for the typed decoders in TopasResponseDecoder.
+    //  The future holds an empty string if the transfer failed.
+    std::future<std::string> getRawAsync(const std::string& url) const;
 
     bool isInitialized() const;
     std::string baseAddress() const;
     void setBaseAddress(const std::string& baseAddressToSet);
 
+    //  Breaker of the current base address (nullptr before there is one). While it is open, requests fail within
+    //  microseconds instead of each waiting for a connection, and only the periodic probe reaches the device.
+    //  Callers can check its state() to tell an unreachable device from other errors.
+    std::shared_ptr<TopasCircuitBreaker> circuitBreaker() const;
+
+    //  Uses a (shared) running discovery service: initializeWithSerialNumber looks the device up in its registry
+    //  before probing, and the base address follows the device if it comes back under a new URL.
+    void useDiscoveryService(const std::shared_ptr<TopasLocator>& service);
+
 private:
     std::string m_serialNum;
     TopasLocator m_locator;
     bool m_initialized;
     std::string m_baseAddress;
+    mutable std::mutex m_baseAddressMutex;  //  the discovery service may change the address while requests run
+    unsigned long m_baseAddressGeneration;  //  bumped by setBaseAddress, so poll endpoints know to rebuild their URL
+    std::shared_ptr<TopasCircuitBreaker> m_circuitBreaker;  //  of m_baseAddress, same mutex
+    std::shared_ptr<TopasLocator> m_discoveryService;
+    int m_discoveryCallbackId;
+
+    //  Pool of reusable CURL easy handles. A handle keeps its connection to the REST server open
+    //  between requests, so a steady-state poll is one request/response on an already open socket
+    //  instead of a fresh TCP handshake. Handles are checked out per request, so concurrent callers are fine.
+    static const size_t MAX_IDLE_HANDLES = 4;
+    mutable std::mutex m_poolMutex;
+    mutable std::vector<CURL*> m_idleHandles;
+    CURLSH* m_share;  //  DNS cache shared between all pooled handles
+    std::mutex m_shareLocks[CURL_LOCK_DATA_LAST];
+    struct curl_slist* m_jsonHeaders;  //  built once, reused by every PUT/POST
+
+    static void lockShare(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+    static void unlockShare(CURL* handle, curl_lock_data data, void* userptr);
+
+    //  See addPollEndpoint. Only touched with mutex held.
+    static const size_t POLL_BUFFER_SIZE = 4096;
+    struct PollEndpoint{
+        std::mutex mutex;
+        std::string url;
+        std::string fullUrl;
+        unsigned long generation;
+        CURL* curl;
+        std::string response;
+        TopasResponseSink sink;
+        std::shared_ptr<TopasCircuitBreaker> breaker;
+    };
+    mutable std::mutex m_pollEndpointsMutex;
+    std::vector<std::unique_ptr<PollEndpoint> > m_pollEndpoints;
+    PollEndpoint* pollEndpoint(int endpoint) const;
+    bool performPoll(PollEndpoint& endpoint) const;
+
+    bool checkBaseAddress(const std::string& baseAddress, long connectTimeoutMs, bool verbose) const;
+    CURL* acquireHandle() const;
+    void releaseHandle(CURL* curl) const;
+    void prepareHandle(CURL* curl, const char* method, const std::string& fullUrl, const std::string* body, TopasResponseSink* sink) const;
+    json performStreamedGet(const std::string& url, struct curl_slist* headers, CacheValidators* received, CURLcode& res, long& httpResponseCode) const;
+
+    static const size_t DEFAULT_MAX_RESPONSE_SIZE = 8 * 1024 * 1024;
+    std::atomic<size_t> m_maxResponseSize;
+    mutable std::mutex m_policyMutex;
+    TopasRequestPolicy m_requestPolicy;
+    json performRequest(const char* method, const std::string& url, const json* data, const TopasRequestPolicy& policy) const;
+    CURLcode performTransfer(CURL* curl, const char* method, const std::string& fullUrl, const TopasRequestPolicy& policy, TopasResponseSink& sink, TopasCircuitBreaker* breaker) const;
+    void reportFailure(const char* method, CURLcode res) const;
+    std::future<json> performRequestAsync(const char* method, const std::string& url, const json* data, const ResponseCallback& onComplete) const;
+    json parseResponse(const char* method, CURLcode res, const std::string& response) const;
+    bool submitAsync(CURL* curl, const std::function<void(CURLcode)>& onDone) const;
+
+    //  Bookkeeping of async requests still owned by the engine
+    mutable std::mutex m_asyncMutex;
+    mutable std::condition_variable m_asyncDone;
+    mutable size_t m_asyncInFlight;
 };
 
+template<typename Decoder>
+bool TopasCommunicator::poll(int endpoint, Decoder decode) const {
+    PollEndpoint* state = pollEndpoint(endpoint);
+    if(!state) {return false;}
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return performPoll(*state) && decode(state->response.data(), state->response.size());
+}
+
 
-#endif
\ No newline at end of file
+#endif
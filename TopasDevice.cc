@@ -6,13 +6,31 @@
 TopasDevice::TopasDevice() : 
     m_serialNum{""}, 
     m_initialized{false}, 
-    m_http_communicator()
+    m_http_communicator(),
+    m_interactionCacheValid{false},
+    m_interactionCacheTTL{std::chrono::seconds(60)},
+    m_interactionIndex{std::make_shared<TopasInteractionIndex>()},
+    m_selectionPolicy{TopasInteractionIndex::firstMatch()},
+    m_telemetryStop{false},
+    m_telemetryRunning{false},
+    m_telemetryMaxAgeMs{1000},
+    m_nextObserverId{1},
+    m_wavelengthDeadband{0.0f},
+    m_hasReported{false},
+    m_reportedWavelength{-1},
+    m_reportedShutter{ShutterStatus::CLOSED},
+    m_reportedInProgress{false},
+    m_reportedCompletionPart{0}
     //m_shutterStatus{ShutterStatus::CLOSED} 
 {
+    m_wavelengthStatusEndpoint = m_http_communicator.addPollEndpoint(WAVELENGTH_STATUS_ADDRESS);
+    m_shutterStatusEndpoint = m_http_communicator.addPollEndpoint(SHUTTER_STATUS_ADDRESS);
+
     //  I am choosing to not have member variables to represent device status
     //  Instead, the status of various things (shutter, wavelength etc) is only avaiable through
     //  Getter methods which send HTTP requests everytime. This way information is always up-to-date
-    //  But at the cost of sending extra HTTP requests. If latency becomes an issue, can switch back to using member vars.
+    //  But at the cost of sending extra HTTP requests. If latency becomes an issue, startTelemetry() switches to
+    //  reading the latest background sample instead, as long as it is not older than the telemetry max age.
 
     /*
     // Use communicator to get shutter status, wavelength
@@ -25,12 +43,24 @@ TopasDevice::TopasDevice() :
 }
 
 TopasDevice::~TopasDevice(){
+    stopTelemetry();
+
+    //  Outstanding operations still use this device. Cancel them first, so a move in flight does not keep us
+    //  waiting for its whole timeout (or for someone to answer a user action prompt).
+    std::lock_guard<std::mutex> lock(m_operationMutex);
+    for(auto& operation : m_operations) {operation.first.cancel();}
+    for(auto& operation : m_operations) {operation.second.wait();}
 
 }
 
 void TopasDevice::initializeWithSerialNumber(const std::string& serialNum){
+    initializeWithSerialNumber(serialNum, std::shared_ptr<TopasDiscoveryCache>());
+}
+
+void TopasDevice::initializeWithSerialNumber(const std::string& serialNum, const std::shared_ptr<TopasDiscoveryCache>& cache){
     m_serialNum = serialNum;
-    m_initialized = m_http_communicator.initializeWithSerialNumber(serialNum);
+    invalidateInteractionCache();
+    m_initialized = m_http_communicator.initializeWithSerialNumber(serialNum, cache);
     if(!m_initialized){
         std::cerr << "[ERROR] Failed to initialize http_communicator to serial number: " << serialNum << std::endl;
         return;
@@ -39,6 +69,7 @@ void TopasDevice::initializeWithSerialNumber(const std::string& serialNum){
 }
 
 void TopasDevice::initializeWithBaseAddress(const std::string& baseAddress){
+    invalidateInteractionCache();
     m_initialized = m_http_communicator.initializeWithBaseAddress(baseAddress);
     if(!m_initialized){
         std::cerr << "[ERROR] Failed to initialize http_communicator to base address: " << baseAddress << std::endl;
@@ -47,10 +78,19 @@ void TopasDevice::initializeWithBaseAddress(const std::string& baseAddress){
     std::cout << "Successfully initialized device with base address: " << baseAddress << std::endl;
 }
 
+void TopasDevice::useDiscoveryService(const std::shared_ptr<TopasLocator>& service){
+    m_http_communicator.useDiscoveryService(service);
+}
+
 bool TopasDevice::isInitialized() const {
     return m_initialized;
 }
 
+TopasCircuitBreaker::State TopasDevice::connectionState() const {
+    std::shared_ptr<TopasCircuitBreaker> breaker = m_http_communicator.circuitBreaker();
+    return breaker ? breaker->state() : TopasCircuitBreaker::State::CLOSED;
+}
+
 std::string TopasDevice::ShutterStatusToString(ShutterStatus status){
     switch(status){
         case(ShutterStatus::OPEN): return "OPEN";
@@ -74,181 +114,742 @@ TopasDevice::ShutterStatus TopasDevice::BooleanToShutterStatus(bool status){
     return (status) ? ShutterStatus::OPEN : ShutterStatus::CLOSED;
 }
 
-bool TopasDevice::isWavelengthInRange(float wavelength, const json& interaction) const {
-    float lowerBound = (float) interaction["OutputRange"]["From"];
-    float upperBound = (float) interaction["OutputRange"]["To"];
-    if((wavelength >= lowerBound) && (wavelength <= upperBound)) {return true;}
-    else {return false;}
+void TopasDevice::setInteractionCacheTTL(std::chrono::milliseconds ttl){
+    std::lock_guard<std::mutex> lock(m_interactionCacheMutex);
+    m_interactionCacheTTL = ttl;
+}
+
+void TopasDevice::invalidateInteractionCache(){
+    std::lock_guard<std::mutex> lock(m_interactionCacheMutex);
+    m_interactionCacheValid = false;
+    m_interactionIndex = std::make_shared<TopasInteractionIndex>();
+    m_interactionValidators = TopasCommunicator::CacheValidators();
+}
+
+void TopasDevice::setInteractionSelectionPolicy(const TopasInteractionIndex::SelectionPolicy& policy){
+    std::lock_guard<std::mutex> lock(m_selectionPolicyMutex);
+    m_selectionPolicy = policy ? policy : TopasInteractionIndex::firstMatch();
 }
 
-json TopasDevice::getInteractionFromName(const std::string& interactionName) const {
-    json interactions = m_http_communicator.get(AVAIABLE_INTERACTIONS_ADDRESS);
-    for(const auto& item : interactions){
-        if(item["Type"] == interactionName) {return item;}
+//  Brings the interaction cache up to date (caller holds m_interactionCacheMutex). Within the TTL no request
+//  is sent at all, after it the cache is revalidated and only re-downloaded if the server says it changed.
+void TopasDevice::refreshInteractionCache() const {
+    auto now = std::chrono::steady_clock::now();
+    if(m_interactionCacheValid && (now - m_interactionCacheTime) < m_interactionCacheTTL){
+        return;
+    }
+
+    //  The list is decoded straight from the body into the index, no json DOM is built for it
+    bool notModified = false;
+    std::string body;
+    std::vector<InteractionRange> interactions;
+    bool received = m_http_communicator.getConditional(AVAIABLE_INTERACTIONS_ADDRESS, m_interactionValidators, notModified, body);
+    if(received && notModified && m_interactionCacheValid){
+        m_interactionCacheTime = now;
+        return;
     }
-    std::cerr << "[WARNING] Could not find interaction with name " << interactionName << ". Returning EMPTY JSON string..." << std::endl;
-    return json();
 
+    if(!received || notModified || !TopasResponseDecoder::decodeInteractions(body, interactions)){
+        //  Keep using the old list rather than failing a wavelength change on a transient error
+        if(m_interactionCacheValid){
+            std::cerr << "[WARNING] Failed to refresh available interactions. Using cached list..." << std::endl;
+        }
+        return;
+    }
+
+    m_interactionIndex = std::make_shared<TopasInteractionIndex>(interactions);
+    m_interactionCacheTime = now;
+    m_interactionCacheValid = true;
+}
+
+std::shared_ptr<const TopasInteractionIndex> TopasDevice::getInteractionIndex() const {
+    std::lock_guard<std::mutex> lock(m_interactionCacheMutex);
+    refreshInteractionCache();
+    return m_interactionIndex;
+}
+
+std::string TopasDevice::getCurrentInteraction() const {
+    std::string interaction;
+    m_http_communicator.poll(m_wavelengthStatusEndpoint, [this, &interaction](const char* data, size_t length) -> bool {
+        if(!TopasResponseDecoder::decodeWavelengthOutput(data, length, m_polledOutput)) {return false;}
+        interaction = m_polledOutput.interaction;
+        return true;
+    });
+    return interaction;
+}
+
+bool TopasDevice::isWavelengthInRange(float wavelength, const InteractionRange& interaction) const {
+    return (wavelength >= interaction.from) && (wavelength <= interaction.to);
 }
 
 float TopasDevice::getCurrentWavelength() const {
-    json data = m_http_communicator.get(WAVELENGTH_STATUS_ADDRESS);
-    return data["Wavelength"].get<float>();
+    TelemetrySample sample;
+    if(freshTelemetry(sample)) {return sample.wavelength;}
+    return readCurrentWavelength();
 }
 
 TopasDevice::ShutterStatus TopasDevice::getShutterStatus() const {
-    bool isShutterOpen = m_http_communicator.get(SHUTTER_STATUS_ADDRESS).get<bool>();
-    return BooleanToShutterStatus(isShutterOpen);
+    TelemetrySample sample;
+    if(freshTelemetry(sample)) {return BooleanToShutterStatus(sample.shutterOpen);}
+    return readShutterStatus();
+}
+
+//  Always asks the device, used where a cached value is not good enough (e.g. verifying a command).
+//  The bodies go through the typed decoders on the prepared poll endpoints, so a poll neither builds a json DOM
+//  nor allocates once the endpoint buffers are warm.
+float TopasDevice::readCurrentWavelength() const {
+    float wavelength = -1;
+    bool received = m_http_communicator.poll(m_wavelengthStatusEndpoint, [this, &wavelength](const char* data, size_t length) -> bool {
+        if(!TopasResponseDecoder::decodeWavelengthOutput(data, length, m_polledOutput)) {return false;}
+        wavelength = m_polledOutput.wavelength;
+        return true;
+    });
+    if(!received) {std::cerr << "[WARNING] Failed to read the current wavelength" << std::endl;}
+    return wavelength;
+}
+
+TopasDevice::ShutterStatus TopasDevice::readShutterStatus() const {
+    bool isShutterOpen = false;
+    bool received = m_http_communicator.poll(m_shutterStatusEndpoint, [&isShutterOpen](const char* data, size_t length) -> bool {
+        return TopasResponseDecoder::decodeShutterStatus(data, length, isShutterOpen);
+    });
+    if(!received) {std::cerr << "[WARNING] Failed to read the shutter status" << std::endl;}
+    return BooleanToShutterStatus(received && isShutterOpen);
+}
+
+//  Sends the shutter and wavelength status requests at the same time, so the snapshot costs
+//  as much as the slowest single request instead of the sum of all of them
+TopasDevice::Snapshot TopasDevice::snapshot() const {
+    std::future<std::string> shutterFuture = m_http_communicator.getRawAsync(SHUTTER_STATUS_ADDRESS);
+    std::future<std::string> outputFuture = m_http_communicator.getRawAsync(WAVELENGTH_STATUS_ADDRESS);
+    std::string shutterBody = shutterFuture.get();
+    std::string outputBody = outputFuture.get();
+
+    bool isShutterOpen = false;
+    WavelengthOutput status;
+    bool shutterValid = TopasResponseDecoder::decodeShutterStatus(shutterBody, isShutterOpen);
+    bool outputValid = TopasResponseDecoder::decodeWavelengthOutput(outputBody, status);
+
+    Snapshot result;
+    result.timestamp = std::chrono::system_clock::now();
+    result.valid = shutterValid && outputValid;
+    result.shutterStatus = BooleanToShutterStatus(shutterValid && isShutterOpen);
+    result.wavelength = -1;
+    result.isWavelengthSettingInProgress = false;
+    result.wavelengthSettingCompletionPart = 0;
+    result.isWaitingForUserAction = false;
+
+    if(!result.valid){
+        std::cerr << "[WARNING] Failed to read a complete device snapshot" << std::endl;
+        return result;
+    }
+
+    result.wavelength = status.wavelength;
+    result.isWavelengthSettingInProgress = status.isWavelengthSettingInProgress;
+    result.wavelengthSettingCompletionPart = status.wavelengthSettingCompletionPart;
+    result.isWaitingForUserAction = status.isWaitingForUserAction;
+    result.interaction = status.interaction;
+    return result;
+}
+
+void TopasDevice::startTelemetry(std::chrono::milliseconds period){
+    stopTelemetry();
+    {
+        std::lock_guard<std::mutex> lock(m_telemetryMutex);
+        m_telemetryStop = false;
+    }
+    m_hasReported = false;  //  observers get the current state again
+    m_telemetryRunning = true;
+    m_telemetryThread = std::thread(&TopasDevice::runTelemetry, this, period);
+}
+
+void TopasDevice::stopTelemetry(){
+    {
+        std::lock_guard<std::mutex> lock(m_telemetryMutex);
+        m_telemetryStop = true;
+    }
+    m_telemetryWake.notify_all();
+    if(m_telemetryThread.joinable()) {m_telemetryThread.join();}
+    m_telemetryRunning = false;
+}
+
+bool TopasDevice::isTelemetryRunning() const {
+    return m_telemetryRunning;
+}
+
+void TopasDevice::setTelemetryMaxAge(std::chrono::milliseconds maxAge){
+    m_telemetryMaxAgeMs = maxAge.count();
+}
+
+//  Telemetry thread: one batched snapshot per period, published to the seqlock
+void TopasDevice::runTelemetry(std::chrono::milliseconds period){
+    std::unique_lock<std::mutex> lock(m_telemetryMutex);
+    while(!m_telemetryStop){
+        lock.unlock();
+        Snapshot status = snapshot();
+
+        TelemetrySample sample;
+        memset(&sample, 0, sizeof(sample));
+        sample.steadyTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        sample.systemTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(status.timestamp.time_since_epoch()).count();
+        sample.valid = status.valid;
+        sample.shutterOpen = ShutterStatusToBoolean(status.shutterStatus);
+        sample.wavelength = status.wavelength;
+        sample.isWavelengthSettingInProgress = status.isWavelengthSettingInProgress;
+        sample.wavelengthSettingCompletionPart = status.wavelengthSettingCompletionPart;
+        sample.isWaitingForUserAction = status.isWaitingForUserAction;
+        strncpy(sample.interaction, status.interaction.c_str(), sizeof(sample.interaction) - 1);
+        m_telemetry.store(sample);
+        if(status.valid) {notifyObservers(status);}
+
+        lock.lock();
+        m_telemetryWake.wait_for(lock, period, [this]{ return m_telemetryStop; });
+    }
+}
+
+int TopasDevice::onWavelengthChanged(const WavelengthCallback& callback){
+    std::lock_guard<std::mutex> lock(m_observerMutex);
+    m_wavelengthObservers[m_nextObserverId] = callback;
+    return m_nextObserverId++;
+}
+
+int TopasDevice::onShutterChanged(const ShutterCallback& callback){
+    std::lock_guard<std::mutex> lock(m_observerMutex);
+    m_shutterObservers[m_nextObserverId] = callback;
+    return m_nextObserverId++;
+}
+
+int TopasDevice::onWavelengthSettingProgress(const ProgressCallback& callback){
+    std::lock_guard<std::mutex> lock(m_observerMutex);
+    m_progressObservers[m_nextObserverId] = callback;
+    return m_nextObserverId++;
+}
+
+void TopasDevice::unsubscribe(int id){
+    std::lock_guard<std::mutex> lock(m_observerMutex);
+    m_wavelengthObservers.erase(id);
+    m_shutterObservers.erase(id);
+    m_progressObservers.erase(id);
+}
+
+void TopasDevice::setWavelengthDeadband(float deadband){
+    m_wavelengthDeadband = deadband;
+}
+
+//  Compares a new sample with what was reported last and calls the observers of whatever changed.
+//  Observers are copied first, so they may (un)subscribe from inside a callback.
+void TopasDevice::notifyObservers(const Snapshot& status){
+    bool wavelengthChanged = !m_hasReported || std::fabs(status.wavelength - m_reportedWavelength) > m_wavelengthDeadband.load();
+    bool shutterChanged = !m_hasReported || status.shutterStatus != m_reportedShutter;
+    bool progressChanged = !m_hasReported || status.isWavelengthSettingInProgress != m_reportedInProgress
+                            || status.wavelengthSettingCompletionPart != m_reportedCompletionPart;
+    m_hasReported = true;
+    if(!wavelengthChanged && !shutterChanged && !progressChanged) {return;}
+
+    std::map<int, WavelengthCallback> wavelengthObservers;
+    std::map<int, ShutterCallback> shutterObservers;
+    std::map<int, ProgressCallback> progressObservers;
+    {
+        std::lock_guard<std::mutex> lock(m_observerMutex);
+        if(wavelengthChanged) {wavelengthObservers = m_wavelengthObservers;}
+        if(shutterChanged) {shutterObservers = m_shutterObservers;}
+        if(progressChanged) {progressObservers = m_progressObservers;}
+    }
+
+    if(wavelengthChanged){
+        m_reportedWavelength = status.wavelength;
+        for(const auto& item : wavelengthObservers) {item.second(status.wavelength);}
+    }
+    if(shutterChanged){
+        m_reportedShutter = status.shutterStatus;
+        for(const auto& item : shutterObservers) {item.second(status.shutterStatus);}
+    }
+    if(progressChanged){
+        m_reportedInProgress = status.isWavelengthSettingInProgress;
+        m_reportedCompletionPart = status.wavelengthSettingCompletionPart;
+        for(const auto& item : progressObservers) {item.second(status.isWavelengthSettingInProgress, status.wavelengthSettingCompletionPart);}
+    }
+}
+
+//  True if telemetry is running and its last sample is valid and within the max age
+bool TopasDevice::freshTelemetry(TelemetrySample& sample) const {
+    if(!m_telemetryRunning || !m_telemetry.load(sample) || !sample.valid) {return false;}
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return (nowNs - sample.steadyTimeNs) <= m_telemetryMaxAgeMs.load() * 1000000;
+}
+
+TopasDevice::Snapshot TopasDevice::latestSnapshot() const {
+    Snapshot result;
+    TelemetrySample sample;
+    if(!m_telemetry.load(sample)){
+        result.valid = false;
+        result.shutterStatus = ShutterStatus::CLOSED;
+        result.wavelength = -1;
+        result.isWavelengthSettingInProgress = false;
+        result.wavelengthSettingCompletionPart = 0;
+        result.isWaitingForUserAction = false;
+        return result;
+    }
+
+    result.timestamp = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(sample.systemTimeNs)));
+    result.valid = sample.valid;
+    result.shutterStatus = BooleanToShutterStatus(sample.shutterOpen);
+    result.wavelength = sample.wavelength;
+    result.isWavelengthSettingInProgress = sample.isWavelengthSettingInProgress;
+    result.wavelengthSettingCompletionPart = sample.wavelengthSettingCompletionPart;
+    result.isWaitingForUserAction = sample.isWaitingForUserAction;
+    result.interaction = sample.interaction;
+    return result;
+}
+
+//  Age of the latest published sample, or milliseconds::max() if there is none
+std::chrono::milliseconds TopasDevice::telemetryAge() const {
+    TelemetrySample sample;
+    if(!m_telemetry.load(sample)) {return std::chrono::milliseconds::max();}
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return std::chrono::milliseconds((nowNs - sample.steadyTimeNs) / 1000000);
 }
 
 void TopasDevice::printDeviceInfo() const {
     //  Display base address, serial number, shutter status, current set wavelength, etc.
+    Snapshot status = snapshot();
+    std::cout << "\n~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~";
+    std::cout << "\nDevice information:\n";
+    std::cout << "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~" << std::endl;
+    std::cout << "Serial number: " << m_serialNum << "\n";
+    std::cout << "Base address: " << m_http_communicator.baseAddress() << "\n";
+    if(!status.valid){
+        std::cout << "Status: UNAVAILABLE" << std::endl;
+        return;
+    }
+    std::cout << "Shutter status: " << ShutterStatusToString(status.shutterStatus) << "\n";
+    std::cout << "Wavelength: " << status.wavelength << "nm";
+    if(!status.interaction.empty()) {std::cout << " (interaction: " << status.interaction << ")";}
+    std::cout << "\n";
+    if(status.isWavelengthSettingInProgress){
+        char progress[64];
+        snprintf(progress, sizeof(progress), "%.1f", status.wavelengthSettingCompletionPart * 100.0);
+        std::cout << "Wavelength setting in progress: " << progress << "% complete\n";
+    }
+    if(status.isWaitingForUserAction) {std::cout << "Waiting for user action!\n";}
+    std::cout << std::endl;
 }
 
 void TopasDevice::printAvailableInteractions() const {
-    json interactions = m_http_communicator.get(AVAIABLE_INTERACTIONS_ADDRESS);
+    std::shared_ptr<const TopasInteractionIndex> index = getInteractionIndex();
     std::cout << "\n~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~";
     std::cout << "\nThe following interactions are avaiable:\n";
     std::cout << "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~" << std::endl;
-    for(const auto& item : interactions){
+    for(const auto& item : index->interactions()){
         std::cout << std::setprecision(4);
-        std::cout << "Interaction Type: " << item["Type"] << "\n";
-        std::cout << "Valid for range: " << (float)item["OutputRange"]["From"] << "nm - " << (float)item["OutputRange"]["To"] << "nm\n\n";
+        std::cout << "Interaction Type: \"" << item.type << "\"\n";
+        std::cout << "Valid for range: " << item.from << "nm - " << item.to << "nm\n\n";
     }
     //std::cout << data << std::endl;
 }
 
-//  Sets the wavelength using the first interaction which is in the proper wavelength range
+//  Sets the wavelength using the interaction picked by the selection policy among all the ones covering the wavelength
 void TopasDevice::setWavelength(float wavelengthToSet) const {
-    json interactions = m_http_communicator.get(AVAIABLE_INTERACTIONS_ADDRESS);
-    for(const auto& item : interactions){
-        if(isWavelengthInRange(wavelengthToSet, item)==true){
-            //  set wavelength using the selected interaction
-            std::cout << "Setting wavelength of " << wavelengthToSet << " using interaction: " << item["Type"] << std::endl;
-            json data = {
-                {"Interaction", item["Type"]},
-                {"Wavelength", wavelengthToSet}
-            };
-            json response = m_http_communicator.put(WAVELENGTH_CONTROL_ADDRESS, data);
-            this->waitForWavelengthSetting();
-            //  wait one second and check if changes went through
-            //std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            if(this->getCurrentWavelength()!=wavelengthToSet){
-                std::cerr << "[WARNING] HTTP request sent, but value has failed to update after 1 second" << std::endl;
-                return;
-            }
+    reportResult(setWavelengthAsync(wavelengthToSet).wait());
+}
 
-            std::cout << " Success!" << std::endl;
-            return;
-        }
-    }
+void TopasDevice::setWavelength(float wavelengthToSet, const std::string& interactionName) const {
+    reportResult(setWavelengthAsync(wavelengthToSet, interactionName).wait());
+}
+
+TopasOperation TopasDevice::setWavelengthAsync(float wavelengthToSet) const {
+    return setWavelengthAsync(wavelengthToSet, "");
+}
 
-    std::cout << "[ERROR] No interaction avaiable to set wavelength of " << wavelengthToSet << "nm" << std::endl;
+//  An empty interactionName lets the selection policy choose
+TopasOperation TopasDevice::setWavelengthAsync(float wavelengthToSet, const std::string& interactionName) const {
+    TopasOperation operation;
+    std::shared_ptr<std::atomic<bool> > cancelled = std::make_shared<std::atomic<bool> >(false);
+    operation.setCancelHandler([this, cancelled]{
+        *cancelled = true;
+        wakeWaiters();
+    });
+    startOperation(operation, [this, operation, wavelengthToSet, interactionName, cancelled]{
+        runWavelengthMove(operation, wavelengthToSet, interactionName, *cancelled);
+    });
+    return operation;
+}
 
+TopasOperation TopasDevice::setShutterStatusAsync(ShutterStatus statusToSet) const {
+    TopasOperation operation;
+    std::shared_ptr<std::atomic<bool> > cancelled = std::make_shared<std::atomic<bool> >(false);
+    operation.setCancelHandler([cancelled]{ *cancelled = true; });
+    startOperation(operation, [this, operation, statusToSet, cancelled]{
+        runShutterChange(operation, statusToSet, *cancelled);
+    });
+    return operation;
 }
 
-void TopasDevice::setWavelength(float wavelengthToSet, const std::string& interactionName) const {
-    //  get the appropriate JSON data based on interaction name
-    json interaction = getInteractionFromName(interactionName);
-    if(interaction.empty()){
-        std::cerr << "[ERROR] Failed to set wavelength due to unrecognized interaction name" << std::endl;
-        return;
+//  Runs work on its own thread. Finished workers are cleaned up here and the rest are joined by the destructor.
+void TopasDevice::startOperation(const TopasOperation& operation, const std::function<void()>& work) const {
+    std::lock_guard<std::mutex> lock(m_operationMutex);
+    for(auto it = m_operations.begin(); it != m_operations.end();){
+        if(it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {it = m_operations.erase(it);}
+        else {++it;}
     }
-    
-    //  check if parameters are valid
-    if(isWavelengthInRange(wavelengthToSet, interaction)==false){
-        std::cerr << "[ERROR] Out of range error. Cannot set wavelength of " << wavelengthToSet << "nm" << "using interaction: ";
-        std::cerr << interaction["Type"] << std::endl;
-        return;
+    m_operations.push_back(std::make_pair(operation, std::async(std::launch::async, work)));
+}
+
+//  Polls condition until it holds or timeout passes. Returns false on timeout or cancellation.
+bool TopasDevice::waitForCondition(const std::function<bool()>& condition, std::chrono::milliseconds timeout, const std::atomic<bool>& cancelled) const {
+    const std::chrono::milliseconds POLL_INTERVAL(50);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while(true){
+        if(condition()) {return true;}
+        if(cancelled || std::chrono::steady_clock::now() + POLL_INTERVAL > deadline) {return false;}
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+}
+
+void TopasDevice::runWavelengthMove(const TopasOperation& operation, float wavelengthToSet, const std::string& interactionName, const std::atomic<bool>& cancelled) const {
+    std::shared_ptr<const TopasInteractionIndex> index = getInteractionIndex();
+    InteractionRange interaction;
+
+    if(interactionName.empty()){
+        std::vector<InteractionRange> candidates = index->candidates(wavelengthToSet);
+        if(candidates.empty()){
+            operation.complete(TopasOperation::Status::FAILED, "No interaction avaiable to set wavelength of " + std::to_string(wavelengthToSet) + "nm");
+            return;
+        }
+
+        //  The policy asks the device for its current interaction only if it needs it
+        TopasInteractionIndex::SelectionPolicy policy;
+        {
+            std::lock_guard<std::mutex> lock(m_selectionPolicyMutex);
+            policy = m_selectionPolicy;
+        }
+        int chosen = policy(candidates, wavelengthToSet, [this]{ return getCurrentInteraction(); });
+        if(chosen < 0 || chosen >= (int)candidates.size()){
+            operation.complete(TopasOperation::Status::FAILED, "Interaction selection policy rejected every candidate for " + std::to_string(wavelengthToSet) + "nm");
+            return;
+        }
+        interaction = candidates[chosen];
+    } else {
+        //  look up the interaction by name in the (cached) interaction index
+        if(!index->findByName(interactionName, interaction)){
+            operation.complete(TopasOperation::Status::FAILED, "Failed to set wavelength due to unrecognized interaction name " + interactionName);
+            return;
+        }
+
+        //  check if parameters are valid
+        if(isWavelengthInRange(wavelengthToSet, interaction)==false){
+            operation.complete(TopasOperation::Status::FAILED, "Out of range error. Cannot set wavelength of " + std::to_string(wavelengthToSet) + "nm using interaction: " + interaction.type);
+            return;
+        }
     }
 
     //  pack data to send in request into a JSON format
     json data = {
-        {"Interaction", interaction["Type"]},
+        {"Interaction", interaction.type},
         {"Wavelength", wavelengthToSet}
     };
 
+    //  a cancel that came in during the lookup stops the move before it reaches the device
+    if(cancelled){
+        operation.complete(TopasOperation::Status::CANCELLED, "Wavelength setting was cancelled before it was sent");
+        return;
+    }
+
     //  send HTTP request
-    std::cout << "Setting wavelength of " << wavelengthToSet << " using interaction: " << interaction["Type"] << std::endl;
+    std::cout << "Setting wavelength of " << wavelengthToSet << " using interaction: " << interaction.type << std::endl;
     json response = m_http_communicator.put(WAVELENGTH_CONTROL_ADDRESS, data);
-    this->waitForWavelengthSetting();
-
-    //  wait one second and check if changes went through (maybe remove this)
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-    if(this->getCurrentWavelength()!=wavelengthToSet){
-        std::cerr << "[WARNING] HTTP request sent, but value has failed to update after 1 second" << std::endl;
+    WaitStats stats = this->waitForWavelengthSetting(std::chrono::minutes(5), cancelled);
+    if(stats.cancelled){
+        operation.complete(TopasOperation::Status::CANCELLED, "Wavelength setting was cancelled");
         return;
     }
-    
-    std::cout << " Success!" << std::endl;
-    return;
+    if(!stats.completed){
+        operation.complete(TopasOperation::Status::TIMED_OUT, "Wavelength setting did not complete");
+        return;
+    }
+    std::cout << "Wavelength setting finished after " << stats.elapsed.count() << "ms (" << stats.polls << " status polls)" << std::endl;
+
+    //  the move is reported done, the read back value should follow shortly
+    std::atomic<bool> neverCancelled(false);
+    float readBack = -1;
+    bool verified = waitForCondition([this, &readBack, wavelengthToSet]{
+        readBack = readCurrentWavelength();
+        return readBack == wavelengthToSet;
+    }, VERIFY_TIMEOUT, neverCancelled);
+    if(!verified){
+        operation.complete(TopasOperation::Status::FAILED, "HTTP request sent, but value has failed to update within " + std::to_string(VERIFY_TIMEOUT.count()) + "ms", readBack);
+        return;
+    }
+    operation.complete(TopasOperation::Status::SUCCEEDED, "Success!", readBack);
+}
+
+void TopasDevice::cancelWavelengthWait() const {
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    for(std::atomic<bool>* cancelled : m_waitCancelFlags) {*cancelled = true;}
+    m_waitCondition.notify_all();
 }
 
-void TopasDevice::waitForWavelengthSetting() const {
+//  Wakes the sleeping waits after a cancel flag was set, so they notice it right away. Taking the mutex makes sure
+//  a wait that has just checked its flag is asleep (and gets the notification) before we notify.
+void TopasDevice::wakeWaiters() const {
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    m_waitCondition.notify_all();
+}
+
+//  Sleeps for interval unless cancelled is set first. Returns true if cancelled.
+bool TopasDevice::sleepUnlessCancelled(std::chrono::milliseconds interval, const std::atomic<bool>& cancelled) const {
+    std::unique_lock<std::mutex> lock(m_waitMutex);
+    return m_waitCondition.wait_for(lock, interval, [&cancelled]{ return cancelled.load(); });
+}
+
+TopasDevice::WaitStats TopasDevice::waitForWavelengthSetting(std::chrono::milliseconds timeout) const {
+    //  Register a flag of our own for cancelWavelengthWait()
+    std::atomic<bool> cancelled(false);
+    std::list<std::atomic<bool>*>::iterator registration;
+    {
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        registration = m_waitCancelFlags.insert(m_waitCancelFlags.end(), &cancelled);
+    }
+    WaitStats stats = waitForWavelengthSetting(timeout, cancelled);
+    {
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        m_waitCancelFlags.erase(registration);
+    }
+    return stats;
+}
+
+//  Polls the wavelength status until the move is done. Instead of spinning, the next poll is scheduled from the
+//  progress rate seen so far: roughly half of the estimated remaining time, clamped to [MIN, MAX]_POLL_INTERVAL.
+//  Without a usable rate estimate the interval backs off exponentially up to MAX_POLL_INTERVAL.
+TopasDevice::WaitStats TopasDevice::waitForWavelengthSetting(std::chrono::milliseconds timeout, const std::atomic<bool>& cancelled) const {
+    const std::chrono::milliseconds MIN_POLL_INTERVAL(50);
+    const std::chrono::milliseconds MAX_POLL_INTERVAL(1000);
+
+    WaitStats stats;
+    stats.polls = 0;
+    stats.completed = false;
+    stats.timedOut = false;
+    stats.cancelled = false;
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + timeout;
+    auto lastSampleTime = start;
+    float lastPart = -1;
+    int lastPerMillePrinted = -1;
+    std::chrono::milliseconds interval = MIN_POLL_INTERVAL;
+    WavelengthOutput status;  //  reused by every poll
+
     while(true){
-        json statusData = m_http_communicator.get(WAVELENGTH_STATUS_ADDRESS);
-        float percentCompletion = (float) statusData["WavelengthSettingCompletionPart"] * 100.0;
-        
-        printf("\rWavelength change in progress. %.1f %% complete!", percentCompletion);
+        bool received = m_http_communicator.poll(m_wavelengthStatusEndpoint, [&status](const char* data, size_t length) -> bool {
+            return TopasResponseDecoder::decodeWavelengthOutput(data, length, status);
+        });
+        auto now = std::chrono::steady_clock::now();
+        ++stats.polls;
+
+        if(received){
+            float part = status.wavelengthSettingCompletionPart;
+
+            //  only print when the displayed value (one decimal of a percent) actually changes. Formatted on the
+            //  side, so std::cout keeps its own precision for everything printed later.
+            int perMille = (int)(part * 1000.0f);
+            if(perMille != lastPerMillePrinted){
+                char progress[64];
+                snprintf(progress, sizeof(progress), "%.1f", part * 100.0f);
+                std::cout << "\rWavelength change in progress. " << progress << " % complete!" << std::flush;
+                lastPerMillePrinted = perMille;
+            }
 
-        if(statusData["IsWavelengthSettingInProgress"] == false || statusData["IsWaitingForUserAction"] == true){
+            if(status.isWaitingForUserAction){
+                if(!handleUserActions(status, cancelled)){
+                    stats.cancelled = true;
+                    break;
+                }
+                //  the move continues after the user actions, so start estimating again
+                lastPart = -1;
+                interval = MIN_POLL_INTERVAL;
+                continue;
+            }
+
+            if(!status.isWavelengthSettingInProgress){
+                stats.completed = true;
+                break;
+            }
+
+            //  Extrapolate the time left from the progress made since the last sample
+            std::chrono::milliseconds estimate = std::chrono::milliseconds::zero();
+            double dt = std::chrono::duration<double>(now - lastSampleTime).count();
+            if(lastPart >= 0 && part > lastPart && dt > 0){
+                double rate = (part - lastPart) / dt;  //  completion part per second
+                estimate = std::chrono::milliseconds((long long)(((1.0 - part) / rate) * 1000.0 / 2.0));
+            }
+            if(estimate > std::chrono::milliseconds::zero()){
+                interval = estimate;
+            } else {
+                interval *= 2;
+            }
+            interval = std::max(MIN_POLL_INTERVAL, std::min(MAX_POLL_INTERVAL, interval));
+            lastPart = part;
+            lastSampleTime = now;
+        } else {
+            //  failed request, don't hammer the server while it recovers
+            interval = std::min(MAX_POLL_INTERVAL, interval * 2);
+        }
+
+        if(now >= deadline){
+            stats.timedOut = true;
+            break;
+        }
+        std::chrono::milliseconds untilDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        if(sleepUnlessCancelled(std::min(interval, untilDeadline), cancelled)){
+            stats.cancelled = true;
             break;
         }
+    }
+    std::cout << std::endl;
 
-        //  Code below only executes after wavelength setting complete or user action requested!
-        //  Query for the status data again:
-        statusData = m_http_communicator.get(WAVELENGTH_STATUS_ADDRESS);
-        if(statusData["IsWaitingForUserAction"] == true){
-            std::cout << "\nUser actions required: \n";
-            for(const auto& msg : statusData["Messages"]){
-                //  print out each message to the user
-                std::cout << msg["Text"].get<std::string>() << ' ';
-                if(msg["Image"].is_null()){
-                    std::cout << std::endl;
-                } 
-                else{
-                    std::cout << ", image name: " << msg["Image"] << std::endl;
-                }
+    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    if(stats.timedOut){
+        std::cerr << "[WARNING] Wavelength setting did not finish within " << timeout.count() << "ms" << std::endl;
+    }
+    if(stats.cancelled){
+        std::cerr << "[WARNING] Waiting for wavelength setting was cancelled" << std::endl;
+    }
+    return stats;
+}
+
+namespace {
+    //  The only reader of std::cin for user action prompts, shared by all devices of the process. A blocked read
+    //  can not be interrupted, so a cancelled prompt leaves the read running on the reader thread; the next
+    //  prompt then waits for that same read instead of starting a second one on the stream.
+    class EnterKeyReader{
+    public:
+        static EnterKeyReader& instance(){
+            //  Never destroyed: the reader thread may still be blocked on std::cin when the process exits
+            static EnterKeyReader* reader = new EnterKeyReader();
+            return *reader;
+        }
+
+        //  Waits for the next Enter. Returns false if cancelled is set first.
+        bool waitForEnter(const std::atomic<bool>& cancelled){
+            std::unique_lock<std::mutex> lock(m_mutex);
+            unsigned long presses = m_presses;
+            ++m_waiting;
+            if(!m_started){
+                m_started = true;
+                std::thread(&EnterKeyReader::run, this).detach();
             }
-            //  wait for user input (hitting Enter key)...
-            std::cout << "\nHit Enter to continue after actions have been performed. " << std::endl;
-            std::cout << std::endl;
-            std::cin.clear();
-            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');  //  skip bad input
-            std::cin.get();
+            m_changed.notify_all();
+
+            bool pressed = false;
+            while(!(pressed = m_changed.wait_for(lock, std::chrono::milliseconds(100), [this, presses]{ return m_presses != presses; }))){
+                if(cancelled) {break;}
+            }
+            --m_waiting;
+            return pressed;
+        }
 
-            //  tell the device that required actions have been performed.  
-            //  if shutter was open before setting wavelength it will be opened again
-            m_http_communicator.put("/Optical/WavelengthControl/FinishWavelengthSettingAfterUserActions", {{"RestoreShutter", true}});
+    private:
+        EnterKeyReader() : m_started{false}, m_waiting{0}, m_presses{0} {}
+
+        //  Reads only while someone is waiting, so lines typed outside a prompt stay in the stream for the application
+        void run(){
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while(true){
+                m_changed.wait(lock, [this]{ return m_waiting > 0; });
+                lock.unlock();
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');  //  skip bad input
+                std::cin.get();
+                lock.lock();
+                ++m_presses;
+                m_changed.notify_all();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_changed;
+        bool m_started;
+        int m_waiting;
+        unsigned long m_presses;
+    };
+}
+
+//  Shows the required actions and waits for Enter. Returns false if cancelled is set first; the prompt is then
+//  left unanswered and the device keeps waiting for the actions.
+bool TopasDevice::handleUserActions(const WavelengthOutput& status, const std::atomic<bool>& cancelled) const {
+    std::cout << "\nUser actions required: \n";
+    for(const auto& msg : status.messages){
+        //  print out each message to the user
+        std::cout << msg.text << ' ';
+        if(msg.image.empty()){
+            std::cout << std::endl;
+        } 
+        else{
+            std::cout << ", image name: " << msg.image << std::endl;
         }
     }
-    //std::cout << "Done setting the wavelength!" << std::endl;
+    //  wait for user input (hitting Enter key)...
+    std::cout << "\nHit Enter to continue after actions have been performed. " << std::endl;
+    std::cout << std::endl;
+    if(!EnterKeyReader::instance().waitForEnter(cancelled)) {return false;}
+
+    //  tell the device that required actions have been performed.  
+    //  if shutter was open before setting wavelength it will be opened again
+    m_http_communicator.put("/Optical/WavelengthControl/FinishWavelengthSettingAfterUserActions", {{"RestoreShutter", true}});
+    return true;
 }
 
 void TopasDevice::setShutterStatus(ShutterStatus statusToSet) const {
+    reportResult(setShutterStatusAsync(statusToSet).wait());
+}
+
+void TopasDevice::runShutterChange(const TopasOperation& operation, ShutterStatus statusToSet, const std::atomic<bool>& cancelled) const {
+    //  Setting the shutter to a state is harmless to repeat, so let the PUT be retried on a network blip
+    TopasRequestPolicy policy = m_http_communicator.requestPolicy();
+    policy.retryNonIdempotent = true;
+
     json response;
     switch(statusToSet){
         case(ShutterStatus::OPEN):
             std::cout << "Requesting to open shutter... " << std::endl;
-            response = m_http_communicator.put(SHUTTER_CONTROL_ADDRESS, true);
+            response = m_http_communicator.put(SHUTTER_CONTROL_ADDRESS, true, policy);
             std::cout << "Response from request to open shutter is: " << response << std::endl;
             break;
         case(ShutterStatus::CLOSED):
             std::cout << "Requesting to close shutter... " << std::endl;
-            response = m_http_communicator.put(SHUTTER_CONTROL_ADDRESS, false);
+            response = m_http_communicator.put(SHUTTER_CONTROL_ADDRESS, false, policy);
             break;
         default:
-            std::cerr << "setShutterStatus received unknown ShutterStatus type. Please try again" << std::endl;
+            operation.complete(TopasOperation::Status::FAILED, "setShutterStatus received unknown ShutterStatus type. Please try again");
             return;
     }
 
-    //  wait one second and check if changes went through
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-    if(this->getShutterStatus()!=statusToSet){
-        std::cerr << "[WARNING] HTTP request sent, but value has failed to update after 1 second" << std::endl;
+    //  check until the change went through instead of always sleeping a full second
+    bool verified = waitForCondition([this, statusToSet]{
+        return this->readShutterStatus() == statusToSet;
+    }, VERIFY_TIMEOUT, cancelled);
+    if(cancelled){
+        operation.complete(TopasOperation::Status::CANCELLED, "Shutter verification was cancelled");
+        return;
+    }
+    if(!verified){
+        operation.complete(TopasOperation::Status::FAILED, "HTTP request sent, but value has failed to update within " + std::to_string(VERIFY_TIMEOUT.count()) + "ms");
         return;
     }
+    operation.complete(TopasOperation::Status::SUCCEEDED, "Success!", ShutterStatusToBoolean(statusToSet) ? 1.0f : 0.0f);
+}
 
-    std::cout << "Success!" << std::endl;
-    return;
-}
\ No newline at end of file
+//  Prints the outcome of an operation the way the blocking setters always have
+void TopasDevice::reportResult(const TopasOperation::Result& result) const {
+    switch(result.status){
+        case(TopasOperation::Status::SUCCEEDED):
+            std::cout << " " << result.message << std::endl;
+            break;
+        case(TopasOperation::Status::FAILED):
+            std::cerr << "[ERROR] " << result.message << std::endl;
+            break;
+        default:
+            std::cerr << "[WARNING] " << result.message << std::endl;
+            break;
+    }
+}
@@ -3,12 +3,25 @@
 
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <list>
+#include <map>
+#include <cmath>
+#include <cstdio>
 
 #ifdef _WIN32
     #define NOMINMAX  //  so that max() works properly with C++ standard library as opposed to being overwritten by windows.h implementation!
 #endif
 
 #include "TopasCommunicator.hh"
+#include "TopasInteractionIndex.hh"
+#include "TopasResponseDecoder.hh"
+#include "TopasOperation.hh"
+#include "TopasSeqLock.hh"
 
 class TopasDevice{
 public:
@@ -20,22 +33,100 @@ public:
     static std::string ShutterStatusToString(ShutterStatus status);
     static bool ShutterStatusToBoolean(ShutterStatus status);
     static ShutterStatus BooleanToShutterStatus(bool status);
+
+    //  Consistent view of the device status. All fields come from one concurrent batch of requests
+    //  and share a single timestamp. valid is false if any of the requests failed.
+    struct Snapshot{
+        std::chrono::system_clock::time_point timestamp;
+        bool valid;
+        ShutterStatus shutterStatus;
+        float wavelength;
+        bool isWavelengthSettingInProgress;
+        float wavelengthSettingCompletionPart;
+        bool isWaitingForUserAction;
+        std::string interaction;
+    };
+
+    //  Outcome of waiting for a wavelength move. Exactly one of completed/timedOut/cancelled is true.
+    struct WaitStats{
+        int polls;
+        std::chrono::milliseconds elapsed;
+        bool completed;
+        bool timedOut;
+        bool cancelled;
+    };
+
+    //  Observers of the telemetry thread (see onWavelengthChanged). They run on that thread, so keep them short.
+    typedef std::function<void(float wavelength)> WavelengthCallback;
+    typedef std::function<void(ShutterStatus status)> ShutterCallback;
+    typedef std::function<void(bool inProgress, float completionPart)> ProgressCallback;
 public:
     TopasDevice();
     ~TopasDevice();
 
     void initializeWithSerialNumber(const std::string& serialNum);
+    //  Same, but tries the address remembered in cache first (see TopasCommunicator)
+    void initializeWithSerialNumber(const std::string& serialNum, const std::shared_ptr<TopasDiscoveryCache>& cache);
     void initializeWithBaseAddress(const std::string& httpAddress);
 
+    //  See TopasCommunicator::useDiscoveryService. Call before initializeWithSerialNumber.
+    void useDiscoveryService(const std::shared_ptr<TopasLocator>& service);
+
     bool isInitialized() const;
+    //  State of the circuit breaker for the device address: OPEN means it stopped answering and requests fail
+    //  fast until a probe gets through (see TopasCircuitBreaker). CLOSED before initialization.
+    TopasCircuitBreaker::State connectionState() const;
     void setShutterStatus(ShutterStatus status) const;
     void setWavelength(float wavelength) const;
     void setWavelength(float wavelength, const std::string& interactionName) const;
 
+    //  Non-blocking versions of the setters above. They return right away; the command runs and is verified
+    //  in the background and the handle reports the final result.
+    TopasOperation setShutterStatusAsync(ShutterStatus status) const;
+    TopasOperation setWavelengthAsync(float wavelength) const;
+    TopasOperation setWavelengthAsync(float wavelength, const std::string& interactionName) const;
+
+    //  While telemetry is running and its last sample is younger than the telemetry max age, these two
+    //  return the published sample without any HTTP request on the caller's thread
     ShutterStatus getShutterStatus() const;
     float getCurrentWavelength() const;
+    Snapshot snapshot() const;
+
+    //  Telemetry mode: a background thread takes a snapshot() every period and publishes it lock-free.
+    void startTelemetry(std::chrono::milliseconds period);
+    void stopTelemetry();
+    bool isTelemetryRunning() const;
+    void setTelemetryMaxAge(std::chrono::milliseconds maxAge);
+    //  Latest published sample (valid is false if there is none yet or the last poll failed) and its age
+    Snapshot latestSnapshot() const;
+    std::chrono::milliseconds telemetryAge() const;
+
+    //  Change notifications from the telemetry thread. A callback fires for the first valid sample and afterwards
+    //  only when the polled value differs from the last one reported; the wavelength has to move by more than the
+    //  deadband (nm). Each call returns an id for unsubscribe().
+    int onWavelengthChanged(const WavelengthCallback& callback);
+    int onShutterChanged(const ShutterCallback& callback);
+    int onWavelengthSettingProgress(const ProgressCallback& callback);
+    void unsubscribe(int id);
+    void setWavelengthDeadband(float deadband);
     void printDeviceInfo() const;
     void printAvailableInteractions() const;
+
+    //  The ExpandedInteractions document is cached per device. After ttl has passed it is revalidated
+    //  with a conditional GET (ETag/If-Modified-Since), so an unchanged list is never re-downloaded.
+    void setInteractionCacheTTL(std::chrono::milliseconds ttl);
+    void invalidateInteractionCache();
+
+    //  Decides which interaction setWavelength(float) uses when several cover the wavelength.
+    //  Defaults to TopasInteractionIndex::firstMatch(); preferCurrent() avoids needless interaction changes.
+    void setInteractionSelectionPolicy(const TopasInteractionIndex::SelectionPolicy& policy);
+
+    //  Blocks until the current wavelength move is finished, timeout has passed or cancelWavelengthWait() is called.
+    //  The poll interval adapts to the reported progress, so a move costs a handful of requests instead of a busy loop.
+    WaitStats waitForWavelengthSetting(std::chrono::milliseconds timeout = std::chrono::minutes(5)) const;
+    //  Cancels the waitForWavelengthSetting calls running right now. Operations from setWavelengthAsync are
+    //  cancelled through their own handle instead.
+    void cancelWavelengthWait() const;
 private:
     std::string m_serialNum;
     bool m_initialized;
@@ -48,9 +139,85 @@ private:
     const std::string SHUTTER_STATUS_ADDRESS = "/ShutterInterlock/IsShutterOpen";
     const std::string AVAIABLE_INTERACTIONS_ADDRESS = "/Optical/WavelengthControl/ExpandedInteractions";
 
-    bool isWavelengthInRange(float wavelength, const json& item) const;
-    json getInteractionFromName(const std::string& interactionName) const;
-    void waitForWavelengthSetting() const;
+    //  Status reads go through prepared poll endpoints (see TopasCommunicator::addPollEndpoint), so a steady-state
+    //  poll does not allocate. m_polledOutput is the reused decode target, only touched inside a wavelength poll.
+    int m_wavelengthStatusEndpoint;
+    int m_shutterStatusEndpoint;
+    mutable WavelengthOutput m_polledOutput;
+
+    //  Interaction cache (see setInteractionCacheTTL)
+    mutable std::mutex m_interactionCacheMutex;
+    mutable bool m_interactionCacheValid;
+    mutable std::chrono::steady_clock::time_point m_interactionCacheTime;
+    mutable TopasCommunicator::CacheValidators m_interactionValidators;
+    std::chrono::milliseconds m_interactionCacheTTL;
+    mutable std::shared_ptr<const TopasInteractionIndex> m_interactionIndex;  //  compiled from the decoded document
+    mutable std::mutex m_selectionPolicyMutex;  //  the policy is read by the operation threads
+    TopasInteractionIndex::SelectionPolicy m_selectionPolicy;
+
+    void refreshInteractionCache() const;
+    std::shared_ptr<const TopasInteractionIndex> getInteractionIndex() const;
+    std::string getCurrentInteraction() const;
+    bool isWavelengthInRange(float wavelength, const InteractionRange& interaction) const;
+    bool handleUserActions(const WavelengthOutput& status, const std::atomic<bool>& cancelled) const;
+    WaitStats waitForWavelengthSetting(std::chrono::milliseconds timeout, const std::atomic<bool>& cancelled) const;
+    bool sleepUnlessCancelled(std::chrono::milliseconds interval, const std::atomic<bool>& cancelled) const;
+    void wakeWaiters() const;
+
+    //  Every wait sleeps on m_waitCondition and has its own cancel flag; whoever sets a flag notifies (wakeWaiters)
+    mutable std::mutex m_waitMutex;
+    mutable std::condition_variable m_waitCondition;
+    mutable std::list<std::atomic<bool>*> m_waitCancelFlags;  //  of the running waitForWavelengthSetting calls
+
+    //  How long a finished command may take to show up in the read back status
+    const std::chrono::milliseconds VERIFY_TIMEOUT{std::chrono::seconds(2)};
+    mutable std::mutex m_operationMutex;
+    mutable std::list<std::pair<TopasOperation, std::future<void> > > m_operations;  //  background operations, cancelled and joined on destruction
+
+    void startOperation(const TopasOperation& operation, const std::function<void()>& work) const;
+    bool waitForCondition(const std::function<bool()>& condition, std::chrono::milliseconds timeout, const std::atomic<bool>& cancelled) const;
+    void runWavelengthMove(const TopasOperation& operation, float wavelength, const std::string& interactionName, const std::atomic<bool>& cancelled) const;
+    void runShutterChange(const TopasOperation& operation, ShutterStatus status, const std::atomic<bool>& cancelled) const;
+    void reportResult(const TopasOperation::Result& result) const;
+
+    //  Plain copy of a Snapshot that fits in the seqlock
+    struct TelemetrySample{
+        int64_t steadyTimeNs;  //  for the age
+        int64_t systemTimeNs;  //  for Snapshot::timestamp
+        bool valid;
+        bool shutterOpen;
+        float wavelength;
+        bool isWavelengthSettingInProgress;
+        float wavelengthSettingCompletionPart;
+        bool isWaitingForUserAction;
+        char interaction[48];
+    };
+    TopasSeqLock<TelemetrySample> m_telemetry;
+    std::thread m_telemetryThread;
+    std::mutex m_telemetryMutex;
+    std::condition_variable m_telemetryWake;
+    bool m_telemetryStop;
+    std::atomic<bool> m_telemetryRunning;
+    std::atomic<int64_t> m_telemetryMaxAgeMs;
+
+    void runTelemetry(std::chrono::milliseconds period);
+    void notifyObservers(const Snapshot& status);
+
+    //  Observers, and the last state reported to them (only touched by the telemetry thread)
+    std::mutex m_observerMutex;
+    int m_nextObserverId;
+    std::map<int, WavelengthCallback> m_wavelengthObservers;
+    std::map<int, ShutterCallback> m_shutterObservers;
+    std::map<int, ProgressCallback> m_progressObservers;
+    std::atomic<float> m_wavelengthDeadband;
+    bool m_hasReported;
+    float m_reportedWavelength;
+    ShutterStatus m_reportedShutter;
+    bool m_reportedInProgress;
+    float m_reportedCompletionPart;
+    bool freshTelemetry(TelemetrySample& sample) const;
+    float readCurrentWavelength() const;
+    ShutterStatus readShutterStatus() const;
 };
 
 
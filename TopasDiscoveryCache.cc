@@ -0,0 +1,91 @@
+#include "TopasDiscoveryCache.hh"
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+
+#ifdef _WIN32
+    #include <windows.h>
+#endif
+
+const char* TopasDiscoveryCache::DEFAULT_PATH = "topas4_discovery_cache.json";
+
+TopasDiscoveryCache::TopasDiscoveryCache(const std::string& path) : m_path{path}, m_entries(json::object()) {
+    load();
+}
+
+//  A missing file just means an empty cache
+bool TopasDiscoveryCache::load(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries = json::object();
+    std::ifstream file(m_path);
+    if(!file.is_open()) {return false;}
+    try{
+        json data = json::parse(file);
+        if(data.is_object()) {m_entries = data;}
+    } catch(const std::exception& e){
+        std::cerr << "[WARNING] Ignoring unreadable discovery cache " << m_path << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool TopasDiscoveryCache::lookup(const std::string& serialNum, std::string& url) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(serialNum);
+    if(it == m_entries.end() || !it->is_object() || !it->contains("url") || !(*it)["url"].is_string()) {return false;}
+    url = (*it)["url"].get<std::string>();
+    return !url.empty();
+}
+
+void TopasDiscoveryCache::store(const std::string& serialNum, const std::string& url){
+    if(serialNum.empty() || url.empty()) {return;}
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(serialNum);
+    if(it != m_entries.end() && it->is_object() && it->value("url", "") == url) {return;}  //  nothing new, skip the write
+
+    m_entries[serialNum] = {
+        {"url", url},
+        {"updated", (long long)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()}
+    };
+    saveLocked();
+}
+
+void TopasDiscoveryCache::remove(const std::string& serialNum){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_entries.erase(serialNum) > 0) {saveLocked();}
+}
+
+bool TopasDiscoveryCache::save() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return saveLocked();
+}
+
+//  Writes to a temporary file first, so a crash never leaves a half written cache behind
+bool TopasDiscoveryCache::saveLocked() const {
+    std::string tmpPath = m_path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        if(!file.is_open()){
+            std::cerr << "[WARNING] Could not write discovery cache " << tmpPath << std::endl;
+            return false;
+        }
+        file << m_entries.dump(2) << std::endl;
+        if(!file.good()) {return false;}
+    }
+    //  Replace the old file in one step, so there is no moment without a cache (rename does not overwrite on Windows)
+    #ifdef _WIN32
+        bool replaced = MoveFileExA(tmpPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    #else
+        bool replaced = std::rename(tmpPath.c_str(), m_path.c_str()) == 0;
+    #endif
+    if(!replaced){
+        std::cerr << "[WARNING] Could not replace discovery cache " << m_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+const std::string& TopasDiscoveryCache::path() const {
+    return m_path;
+}
@@ -0,0 +1,36 @@
+#ifndef TOPASDISCOVERYCACHE_HH
+#define TOPASDISCOVERYCACHE_HH
+
+#include <string>
+#include <mutex>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+//  Small on-disk map of serial number -> PublicApiRestUrl_Version0, so a restarted process can try the
+//  last known address right away instead of waiting for discovery. Stored as a JSON object:
+//  { "<serial number>": { "url": "<rest url>", "updated": <unix time> }, ... }
+class TopasDiscoveryCache{
+public:
+    static const char* DEFAULT_PATH;
+
+    explicit TopasDiscoveryCache(const std::string& path = DEFAULT_PATH);
+
+    bool lookup(const std::string& serialNum, std::string& url) const;
+    void store(const std::string& serialNum, const std::string& url);  //  saves the file if the entry changed
+    void remove(const std::string& serialNum);
+
+    bool load();
+    bool save() const;
+    const std::string& path() const;
+
+private:
+    std::string m_path;
+    mutable std::mutex m_mutex;
+    json m_entries;
+
+    bool saveLocked() const;
+};
+
+
+#endif
@@ -0,0 +1,131 @@
+#include "TopasInteractionIndex.hh"
+#include <algorithm>
+#include <iostream>
+
+TopasInteractionIndex::SelectionPolicy TopasInteractionIndex::firstMatch(){
+    return [](const std::vector<InteractionRange>& candidates, float, const CurrentInteractionQuery&) -> int {
+        return candidates.empty() ? -1 : 0;
+    };
+}
+
+TopasInteractionIndex::SelectionPolicy TopasInteractionIndex::narrowestRange(){
+    return [](const std::vector<InteractionRange>& candidates, float, const CurrentInteractionQuery&) -> int {
+        int best = -1;
+        for(size_t i = 0; i < candidates.size(); ++i){
+            if(best < 0 || (candidates[i].to - candidates[i].from) < (candidates[best].to - candidates[best].from)){
+                best = (int)i;
+            }
+        }
+        return best;
+    };
+}
+
+TopasInteractionIndex::SelectionPolicy TopasInteractionIndex::preferCurrent(const SelectionPolicy& fallback){
+    return [fallback](const std::vector<InteractionRange>& candidates, float wavelength, const CurrentInteractionQuery& currentInteraction) -> int {
+        //  Only ask the device when there is actually a choice to make
+        if(candidates.size() > 1 && currentInteraction){
+            std::string current = currentInteraction();
+            for(size_t i = 0; i < candidates.size(); ++i){
+                if(candidates[i].type == current) {return (int)i;}
+            }
+        }
+        return fallback(candidates, wavelength, currentInteraction);
+    };
+}
+
+TopasInteractionIndex::TopasInteractionIndex(){
+
+}
+
+TopasInteractionIndex::TopasInteractionIndex(const json& interactions){
+    build(interactions);
+}
+
+TopasInteractionIndex::TopasInteractionIndex(const std::vector<InteractionRange>& interactions){
+    build(interactions);
+}
+
+void TopasInteractionIndex::build(const json& interactions){
+    //  Copy the interesting bits out of the JSON once, skipping malformed entries
+    std::vector<InteractionRange> entries;
+    for(const auto& item : interactions){
+        if(!item.is_object() || !item.contains("Type") || !item.contains("OutputRange")) {continue;}
+        const json& range = item["OutputRange"];
+        if(!range.contains("From") || !range.contains("To") || !range["From"].is_number() || !range["To"].is_number()) {continue;}
+
+        InteractionRange entry;
+        entry.type = item["Type"].is_string() ? item["Type"].get<std::string>() : item["Type"].dump();
+        entry.from = range["From"].get<float>();
+        entry.to = range["To"].get<float>();
+        entries.push_back(entry);
+    }
+    build(entries);
+}
+
+void TopasInteractionIndex::build(const std::vector<InteractionRange>& interactions){
+    m_interactions = interactions;
+    m_bounds.clear();
+    m_pointCover.clear();
+    m_segmentCover.clear();
+
+    for(auto& entry : m_interactions){
+        if(entry.to < entry.from) {std::swap(entry.from, entry.to);}
+    }
+
+    for(const auto& entry : m_interactions){
+        m_bounds.push_back(entry.from);
+        m_bounds.push_back(entry.to);
+    }
+    std::sort(m_bounds.begin(), m_bounds.end());
+    m_bounds.erase(std::unique(m_bounds.begin(), m_bounds.end()), m_bounds.end());
+
+    m_pointCover.resize(m_bounds.size());
+    m_segmentCover.resize(m_bounds.empty() ? 0 : m_bounds.size() - 1);
+
+    //  Each interaction covers the boundary points and segments between its own from and to.
+    //  Iterating in document order keeps every cover list in document order as well.
+    for(size_t i = 0; i < m_interactions.size(); ++i){
+        size_t first = std::lower_bound(m_bounds.begin(), m_bounds.end(), m_interactions[i].from) - m_bounds.begin();
+        size_t last = std::lower_bound(m_bounds.begin(), m_bounds.end(), m_interactions[i].to) - m_bounds.begin();
+        for(size_t b = first; b <= last; ++b){
+            m_pointCover[b].push_back(i);
+            if(b < last) {m_segmentCover[b].push_back(i);}
+        }
+    }
+}
+
+std::vector<InteractionRange> TopasInteractionIndex::candidates(float wavelength) const {
+    std::vector<InteractionRange> result;
+    auto it = std::lower_bound(m_bounds.begin(), m_bounds.end(), wavelength);
+    const std::vector<size_t>* cover = nullptr;
+
+    if(it != m_bounds.end() && *it == wavelength){
+        cover = &m_pointCover[it - m_bounds.begin()];
+    } else if(it != m_bounds.begin() && it != m_bounds.end()){
+        cover = &m_segmentCover[(it - m_bounds.begin()) - 1];
+    }
+
+    if(cover){
+        result.reserve(cover->size());
+        for(size_t i : *cover) {result.push_back(m_interactions[i]);}
+    }
+    return result;
+}
+
+bool TopasInteractionIndex::findByName(const std::string& type, InteractionRange& found) const {
+    for(const auto& entry : m_interactions){
+        if(entry.type == type){
+            found = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+const std::vector<InteractionRange>& TopasInteractionIndex::interactions() const {
+    return m_interactions;
+}
+
+bool TopasInteractionIndex::empty() const {
+    return m_interactions.empty();
+}
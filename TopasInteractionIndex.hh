@@ -0,0 +1,55 @@
+#ifndef TOPASINTERACTIONINDEX_HH
+#define TOPASINTERACTIONINDEX_HH
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+//  Plain copy of one entry of the ExpandedInteractions document
+struct InteractionRange{
+    std::string type;
+    float from;
+    float to;
+};
+
+//  Sorted interval index over the OutputRange of every interaction. The wavelength axis is cut at every
+//  range boundary, and each boundary point / elementary segment keeps the list of interactions covering it,
+//  so finding all candidates for a wavelength is one binary search.
+class TopasInteractionIndex{
+public:
+    //  Asks the device which interaction it is using right now (empty if unknown). Costs a request, so policies
+    //  only call it when they actually look at the current interaction.
+    typedef std::function<std::string()> CurrentInteractionQuery;
+    //  Picks one of the candidate interactions covering a wavelength. Returns the position in candidates, or -1 for none.
+    typedef std::function<int(const std::vector<InteractionRange>& candidates, float wavelength, const CurrentInteractionQuery& currentInteraction)> SelectionPolicy;
+
+    static SelectionPolicy firstMatch();  //  first candidate in document order (the original behaviour)
+    static SelectionPolicy narrowestRange();  //  candidate with the smallest OutputRange
+    static SelectionPolicy preferCurrent(const SelectionPolicy& fallback = firstMatch());  //  avoid an interaction change if possible
+
+    TopasInteractionIndex();
+    explicit TopasInteractionIndex(const json& interactions);
+    explicit TopasInteractionIndex(const std::vector<InteractionRange>& interactions);
+
+    void build(const json& interactions);
+    void build(const std::vector<InteractionRange>& interactions);  //  e.g. from TopasResponseDecoder::decodeInteractions
+
+    //  All interactions whose (closed) OutputRange contains wavelength, in document order
+    std::vector<InteractionRange> candidates(float wavelength) const;
+    bool findByName(const std::string& type, InteractionRange& found) const;
+
+    const std::vector<InteractionRange>& interactions() const;
+    bool empty() const;
+
+private:
+    std::vector<InteractionRange> m_interactions;  //  document order
+    std::vector<float> m_bounds;  //  sorted, unique range boundaries
+    std::vector<std::vector<size_t> > m_pointCover;  //  interactions covering m_bounds[i]
+    std::vector<std::vector<size_t> > m_segmentCover;  //  interactions covering (m_bounds[i], m_bounds[i+1])
+};
+
+
+#endif
@@ -1,6 +1,27 @@
 #include "TopasLocator.hh"
+#include "TopasDiscoveryCache.hh"
+
+//  poll() on the discovery sockets. Windows calls it WSAPoll; a function instead of a macro in the header keeps
+//  the name poll free for everyone else.
+static int pollSockets(struct pollfd* entries, unsigned long count, int timeoutMs){
+#ifdef _WIN32
+    return WSAPoll(entries, count, timeoutMs);
+#else
+    return poll(entries, (nfds_t)count, timeoutMs);
+#endif
+}
+
+TopasLocator::TopasLocator() : m_completedRound{false}, m_nextCallbackId{1}, m_serviceStop{false} {
+    m_schedule.retransmits = 2;
+    m_schedule.interval = std::chrono::milliseconds(100);
+    m_schedule.jitter = std::chrono::milliseconds(30);
+    m_schedule.adaptive = true;
+    m_schedule.quietFactor = 4;
+    m_schedule.minQuiet = std::chrono::milliseconds(50);
+    m_lastStats.datagrams = 0;
+    m_lastStats.duplicates = 0;
+    m_lastStats.stoppedEarly = false;
 
-TopasLocator::TopasLocator(){
     #ifdef _WIN32
     WORD wVersionRequested;
     WSADATA wsaData;
@@ -17,28 +38,387 @@ TopasLocator::TopasLocator(){
 }
 
 TopasLocator::~TopasLocator(){
+    stopService();
     #ifdef _WIN32
     WSACleanup();
     #endif
 }
 
-std::vector<json> TopasLocator::locate(){
-    //  Create a UDP socket
-    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if(sock == INVALID_SOCKET){
+std::vector<json> TopasLocator::locate(std::chrono::milliseconds timeout, size_t expectedCount){
+    size_t found = 0;
+    return discover(timeout, [&found, expectedCount](const json&){
+        return (expectedCount > 0) && (++found >= expectedCount);
+    });
+}
+
+json TopasLocator::locateSerial(const std::string& serialNum, std::chrono::milliseconds timeout){
+    std::vector<json> devices = discover(timeout, [&serialNum](const json& device){
+        return device.contains("SerialNumber") && device["SerialNumber"] == serialNum;
+    });
+    for(const auto& device : devices){
+        if(device.contains("SerialNumber") && device["SerialNumber"] == serialNum) {return device;}
+    }
+    return json();
+}
+
+void TopasLocator::setProbeSchedule(const ProbeSchedule& schedule){
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    m_schedule = schedule;
+}
+
+TopasLocator::ProbeSchedule TopasLocator::probeSchedule() const {
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    return m_schedule;
+}
+
+TopasLocator::DiscoveryStats TopasLocator::lastDiscoveryStats() const {
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    return m_lastStats;
+}
+
+void TopasLocator::setCache(const std::shared_ptr<TopasDiscoveryCache>& cache){
+    m_cache = cache;
+}
+
+void TopasLocator::startService(std::chrono::milliseconds period, std::chrono::milliseconds expireAfter){
+    stopService();
+    {
+        std::lock_guard<std::mutex> lock(m_serviceMutex);
+        m_serviceStop = false;
+    }
+    m_serviceThread = std::thread(&TopasLocator::runService, this, period, expireAfter);
+}
+
+void TopasLocator::stopService(){
+    {
+        std::lock_guard<std::mutex> lock(m_serviceMutex);
+        m_serviceStop = true;
+    }
+    m_serviceWake.notify_all();
+    if(m_serviceThread.joinable()) {m_serviceThread.join();}
+}
+
+bool TopasLocator::isServiceRunning() const {
+    return m_serviceThread.joinable();
+}
+
+bool TopasLocator::hasCompletedRound() const {
+    std::lock_guard<std::mutex> lock(m_registryMutex);
+    return m_completedRound;
+}
+
+std::vector<TopasLocator::DeviceRecord> TopasLocator::devices() const {
+    std::lock_guard<std::mutex> lock(m_registryMutex);
+    std::vector<DeviceRecord> result;
+    for(const auto& item : m_registry) {result.push_back(item.second);}
+    return result;
+}
+
+bool TopasLocator::findBySerial(const std::string& serialNum, DeviceRecord& found) const {
+    std::lock_guard<std::mutex> lock(m_registryMutex);
+    for(const auto& item : m_registry){
+        if(item.second.serialNumber == serialNum){
+            found = item.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+int TopasLocator::onDeviceEvent(const DeviceEventCallback& callback){
+    std::lock_guard<std::mutex> lock(m_registryMutex);
+    m_callbacks[m_nextCallbackId] = callback;
+    return m_nextCallbackId++;
+}
+
+void TopasLocator::removeDeviceEventCallback(int id){
+    {
+        std::lock_guard<std::mutex> lock(m_registryMutex);
+        m_callbacks.erase(id);
+    }
+    //  Wait for an event that is being raised right now, it may still call the removed callback
+    std::lock_guard<std::recursive_mutex> dispatch(m_dispatchMutex);
+}
+
+//  Service thread: one discovery round per period
+void TopasLocator::runService(std::chrono::milliseconds period, std::chrono::milliseconds expireAfter){
+    std::unique_lock<std::mutex> lock(m_serviceMutex);
+    while(!m_serviceStop){
+        lock.unlock();
+        std::chrono::milliseconds window = (period < std::chrono::milliseconds(1000)) ? period : std::chrono::milliseconds(1000);
+        std::vector<json> found = discover(window, StopCondition());
+        updateRegistry(found, expireAfter);
+        lock.lock();
+        m_serviceWake.wait_for(lock, period, [this]{ return m_serviceStop; });
+    }
+}
+
+//  Merges one discovery round into the registry and raises the events for whatever changed
+void TopasLocator::updateRegistry(const std::vector<json>& found, std::chrono::milliseconds expireAfter){
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::pair<DeviceEvent, DeviceRecord> > events;
+    {
+        std::lock_guard<std::mutex> lock(m_registryMutex);
+        for(const auto& description : found){
+            //  Skip replies whose fields we can not use rather than letting json throw on the service thread
+            if(!description.contains("SenderGUID") || !description["SenderGUID"].is_string()) {continue;}
+            if(description.contains("SerialNumber") && !description["SerialNumber"].is_string()) {continue;}
+            if(description.contains("PublicApiRestUrl_Version0") && !description["PublicApiRestUrl_Version0"].is_string()) {continue;}
+
+            DeviceRecord record;
+            record.guid = description["SenderGUID"].get<std::string>();
+            record.serialNumber = description.value("SerialNumber", "");
+            record.restUrl = description.value("PublicApiRestUrl_Version0", "");
+            record.description = description;
+            record.lastSeen = now;
+
+            auto it = m_registry.find(record.guid);
+            if(it == m_registry.end()){
+                events.push_back(std::make_pair(DeviceEvent::APPEARED, record));
+            } else if(it->second.restUrl != record.restUrl){
+                events.push_back(std::make_pair(DeviceEvent::URL_CHANGED, record));
+            }
+            m_registry[record.guid] = record;
+        }
+
+        for(auto it = m_registry.begin(); it != m_registry.end();){
+            if(now - it->second.lastSeen > expireAfter){
+                events.push_back(std::make_pair(DeviceEvent::DISAPPEARED, it->second));
+                it = m_registry.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_completedRound = true;
+    }
+
+    for(const auto& event : events) {raise(event.first, event.second);}
+}
+
+//  Holds m_dispatchMutex while calling, so removeDeviceEventCallback can wait for callbacks in progress.
+//  It is recursive so a callback may remove itself.
+void TopasLocator::raise(DeviceEvent event, const DeviceRecord& device){
+    std::lock_guard<std::recursive_mutex> dispatch(m_dispatchMutex);
+    std::map<int, DeviceEventCallback> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(m_registryMutex);
+        callbacks = m_callbacks;
+    }
+    for(const auto& item : callbacks) {item.second(event, device);}
+}
+
+//  One UDP socket per local IPv4 interface, each sending its multicast probe out of that interface
+//  (IP_MULTICAST_IF), so the kernel's choice of default route no longer decides which devices answer.
+//  If the interfaces cannot be listed we fall back to a single socket on the default interface.
+std::vector<TopasLocator::ProbeSocket> TopasLocator::openProbeSockets() const {
+    std::vector<ProbeSocket> sockets;
+    std::vector<std::pair<std::string, struct in_addr> > interfaces;
+
+    #ifdef _WIN32
+        //  Every IPv4 address bound to this host, plus loopback
+        char hostName[256];
+        if(gethostname(hostName, sizeof(hostName)) == 0){
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_DGRAM;
+            struct addrinfo* results = nullptr;
+            if(getaddrinfo(hostName, nullptr, &hints, &results) == 0){
+                for(struct addrinfo* item = results; item; item = item->ai_next){
+                    struct in_addr address = ((struct sockaddr_in*)item->ai_addr)->sin_addr;
+                    interfaces.push_back(std::make_pair(std::string(inet_ntoa(address)), address));
+                }
+                freeaddrinfo(results);
+            }
+        }
+        struct in_addr loopback;
+        loopback.s_addr = htonl(INADDR_LOOPBACK);
+        interfaces.push_back(std::make_pair(std::string("loopback"), loopback));
+    #else
+        struct ifaddrs* list = nullptr;
+        if(getifaddrs(&list) == 0){
+            for(struct ifaddrs* item = list; item; item = item->ifa_next){
+                if(!item->ifa_addr || item->ifa_addr->sa_family != AF_INET) {continue;}
+                if(!(item->ifa_flags & IFF_UP)) {continue;}
+                if(!(item->ifa_flags & (IFF_MULTICAST | IFF_LOOPBACK))) {continue;}
+                interfaces.push_back(std::make_pair(std::string(item->ifa_name), ((struct sockaddr_in*)item->ifa_addr)->sin_addr));
+            }
+            freeifaddrs(list);
+        }
+    #endif
+
+    for(const auto& interface : interfaces){
+        SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(sock == INVALID_SOCKET) {continue;}
+
+        //  Bind to the interface address so the replies come back to this socket
+        struct sockaddr_in localAddr;
+        memset(&localAddr, 0, sizeof(localAddr));
+        localAddr.sin_family = AF_INET;
+        localAddr.sin_addr = interface.second;
+        localAddr.sin_port = 0;
+        if(bind(sock, (struct sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR){
+            closesocket(sock);
+            continue;
+        }
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&interface.second, sizeof(interface.second));
+        int broadcast = 1;  //  needed for the 127.255.255.255 probe on Linux
+        setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char*)&broadcast, sizeof(broadcast));
+
+        ProbeSocket probe;
+        probe.sock = sock;
+        probe.name = interface.first;
+        probe.loopback = (ntohl(interface.second.s_addr) >> 24) == 127;
+        sockets.push_back(probe);
+    }
+
+    if(sockets.empty()){
+        SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(sock == INVALID_SOCKET){
+            #ifdef _WIN32
+                printf("Socket creation failed with error %ld\n", WSAGetLastError());
+            #else
+                printf("Socket creation failed with error %d: %s\n", errno, strerror(errno));
+            #endif
+            return sockets;
+        }
+        int broadcast = 1;
+        setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char*)&broadcast, sizeof(broadcast));
+        ProbeSocket probe;
+        probe.sock = sock;
+        probe.name = "default";
+        probe.loopback = false;
+        sockets.push_back(probe);
+    }
+    return sockets;
+}
+
+//  Sends "Topas4?" to address. Errors are reported but not fatal, the other probes may still work.
+void TopasLocator::sendProbe(const ProbeSocket& probe, const struct sockaddr_in& address) const {
+    //  Define message to send. This will locate Topas4 devices.
+    static const std::string message = "Topas4?";
+    int send_result = sendto(probe.sock, message.c_str(), (int)message.length(), 0, (const struct sockaddr*)&address, sizeof(address));
+    if(send_result == SOCKET_ERROR){
         #ifdef _WIN32
-            printf("Socket creation failed with error %ld. Returning empty vector\n", WSAGetLastError());
+            printf("Sending to %s on %s failed with error %ld\n", inet_ntoa(address.sin_addr), probe.name.c_str(), WSAGetLastError());
         #else
-            printf("Socket creation failed with error %d: %s. Returning empty vector\n", errno, strerror(errno));
+            printf("Sending to %s on %s failed with error %d: %s\n", inet_ntoa(address.sin_addr), probe.name.c_str(), errno, strerror(errno));
         #endif
-        return {};
     }
+}
+
+//  Reads whatever is queued on the socket, up to RING_SIZE datagrams. On Linux this is a single recvmmsg call,
+//  elsewhere one recvfrom. Returns the number of datagrams now in ring.
+int TopasLocator::receiveBatch(const ProbeSocket& probe, ReceiveRing& ring) const {
+    #ifdef _WIN32
+        struct sockaddr_in senderAddr;
+        socklen_t senderAddrSize = sizeof(senderAddr);
+        int bytesReceived = recvfrom(probe.sock, ring.buffers[0], RECEIVE_BUFFER_SIZE - 1, 0, (struct sockaddr*)&senderAddr, &senderAddrSize);
+        if(bytesReceived == SOCKET_ERROR){
+            printf("Error receiving data on %s: %ld\n", probe.name.c_str(), WSAGetLastError());
+            return 0;
+        }
+        ring.lengths[0] = (size_t)bytesReceived;
+        return 1;
+    #else
+        struct mmsghdr messages[RING_SIZE];
+        struct iovec vectors[RING_SIZE];
+        memset(messages, 0, sizeof(messages));
+        for(size_t i = 0; i < RING_SIZE; ++i){
+            vectors[i].iov_base = ring.buffers[i];
+            vectors[i].iov_len = RECEIVE_BUFFER_SIZE - 1;
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int received = recvmmsg(probe.sock, messages, RING_SIZE, MSG_DONTWAIT, nullptr);
+        if(received == SOCKET_ERROR){
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                printf("Error receiving data on %s. Errno %d: %s\n", probe.name.c_str(), errno, strerror(errno));
+            }
+            return 0;
+        }
+        for(int i = 0; i < received; ++i) {ring.lengths[i] = messages[i].msg_len;}
+        return received;
+    #endif
+}
+
+//  Finds the string value of "key" in a JSON text without building a DOM. Good enough for the flat
+//  discovery replies; returns false if the value is missing or contains escapes (the caller then parses fully).
+static bool scanStringField(const char* data, size_t length, const char* key, std::string& value){
+    const char* end = data + length;
+    size_t keyLength = strlen(key);
+    for(const char* p = data; p + keyLength + 2 <= end; ++p){
+        if(*p != '"' || memcmp(p + 1, key, keyLength) != 0 || p[keyLength + 1] != '"') {continue;}
+        const char* q = p + keyLength + 2;
+        while(q < end && isspace((unsigned char)*q)) {++q;}
+        if(q >= end || *q != ':') {continue;}
+        ++q;
+        while(q < end && isspace((unsigned char)*q)) {++q;}
+        if(q >= end || *q != '"') {return false;}
+        const char* valueStart = ++q;
+        while(q < end && *q != '"') {
+            if(*q == '\\') {return false;}
+            ++q;
+        }
+        if(q >= end) {return false;}
+        value.assign(valueStart, q - valueStart);
+        return true;
+    }
+    return false;
+}
+
+//  Turns one datagram into a device description. Replies from a GUID we already have are dropped
+//  after a cheap scan, before the full parse; most replies are duplicates from the repeated probes.
+bool TopasLocator::acceptReply(const char* data, size_t length, std::unordered_set<std::string>& seenGUIDS, json& description){
+    std::string guid;
+    if(scanStringField(data, length, "SenderGUID", guid) && seenGUIDS.count(guid)) {return false;}
+
+    // Parse the message using JSON parse. Check if message is valid.
+    try{
+        description = json::parse(data, data + length);
+    } catch (const json::parse_error& err){
+        std::cerr << "(JSON) Bad data received by locator: " << err.what() << std::endl;
+        return false;
+    }
+    if(!description.is_object() || !description.contains("Identifier") || description["Identifier"]!="Topas4") {return false;}
+
+    //  Remove duplicate devices as they arrive (the same device may answer on several interfaces)
+    if(!description.contains("SenderGUID") || !description["SenderGUID"].is_string()) {return false;}
+    return seenGUIDS.insert(description["SenderGUID"].get<std::string>()).second;
+}
+
+//  Median of the reply round trip times seen so far (zero if there are none)
+static std::chrono::microseconds medianOf(std::vector<std::chrono::microseconds> values){
+    if(values.empty()) {return std::chrono::microseconds::zero();}
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+//  Records a newly found device in the cache, if there is one
+void TopasLocator::rememberDevice(const json& description) const {
+    if(m_cache && description.contains("SerialNumber") && description["SerialNumber"].is_string() && description.contains("PublicApiRestUrl_Version0") && description["PublicApiRestUrl_Version0"].is_string()){
+        m_cache->store(description["SerialNumber"].get<std::string>(), description["PublicApiRestUrl_Version0"].get<std::string>());
+    }
+}
+
+//  Sends the probe schedule (first round right away, then the retransmits with jitter) and collects replies
+//  from all sockets with one poll loop. Stops at the deadline, when done is satisfied, or, once all probes are
+//  out and replies have been seen, when no new device answered for quietFactor x median RTT.
+std::vector<json> TopasLocator::discover(std::chrono::milliseconds timeout, const StopCondition& done){
+    typedef std::chrono::steady_clock Clock;
+    ProbeSchedule schedule = probeSchedule();
+    DiscoveryStats stats;
+    stats.datagrams = 0;
+    stats.duplicates = 0;
+    stats.stoppedEarly = false;
+
+    std::vector<ProbeSocket> sockets = openProbeSockets();
+    if(sockets.empty()) {return {};}
 
     //  Define multicast address
     struct sockaddr_in multicastAddr;
     memset(&multicastAddr, 0, sizeof(multicastAddr)); //basically populates this address with a bunch of 0s first. To prevent random behaviour.
     multicastAddr.sin_family = AF_INET;
-    //multicastAddr.sin_addr.s_addr = inet_addr("239.0.0.181");
     multicastAddr.sin_addr.s_addr = inet_addr("239.0.0.181");
     multicastAddr.sin_port = htons(7415);
 
@@ -49,92 +429,251 @@ std::vector<json> TopasLocator::locate(){
     localhostAddr.sin_addr.s_addr = inet_addr("127.255.255.255"); // double check this with API documentation
     localhostAddr.sin_port = htons(7415);
 
-    //  Define message to send. This will locate Topas4 devices.
-    std::string message = "Topas4?";
+    //  One probe round: multicast out of every interface, the localhost probe only once
+    auto sendRound = [&](){
+        bool sentLocalhost = false;
+        for(const auto& probe : sockets){
+            sendProbe(probe, multicastAddr);
+            if(probe.loopback || (sockets.size() == 1)){
+                sendProbe(probe, localhostAddr);
+                sentLocalhost = true;
+            }
+        }
+        if(!sentLocalhost) {sendProbe(sockets.front(), localhostAddr);}
 
-    //  Send message to multicast address
-    int send_result = 0;
-    send_result = sendto(sock, message.c_str(), message.length(), 0, (struct sockaddr*)&multicastAddr, sizeof(multicastAddr));
-    if(send_result == SOCKET_ERROR){
-        #ifdef _WIN32
-            printf("Sending to multicast address failed with error %ld\n", WSAGetLastError());
-        #else
-            printf("Sending to multicast address failed with error %d: %s\n", errno, strerror(errno));
-        #endif
-    }
+        ProbeStats round;
+        round.sentAt = Clock::now();
+        round.replies = 0;
+        round.newDevices = 0;
+        round.firstReplyRtt = std::chrono::microseconds::zero();
+        stats.probes.push_back(round);
+    };
 
-    //  Send message to localhost address
-    send_result = sendto(sock, message.c_str(), message.length(), 0, (struct sockaddr*)&localhostAddr, sizeof(localhostAddr));
-    if(send_result == SOCKET_ERROR){
-        #ifdef _WIN32
-            printf("Sending to localhost address failed with error %ld\n", WSAGetLastError());
-        #else
-            printf("Sending to localhost address failed with error %d: %s\n", errno, strerror(errno));
-        #endif
+    std::mt19937 random((unsigned)Clock::now().time_since_epoch().count());
+    std::uniform_int_distribution<long long> jitter(0, schedule.jitter.count());
+    auto start = Clock::now();
+    auto deadline = start + timeout;
+    int roundsLeft = schedule.retransmits;
+    sendRound();
+    auto nextProbe = start + schedule.interval + std::chrono::milliseconds(jitter(random));
+
+    //  Set up variables to receive a response. The receive buffers are reused between discovery rounds.
+    std::vector<json> uniqueDevices;
+    std::unordered_set<std::string> seenGUIDS;
+    static thread_local ReceiveRing ring;
+    std::vector<std::chrono::microseconds> rtts;
+    Clock::time_point lastNewDevice = start;
+
+    std::vector<struct pollfd> pollSet(sockets.size());
+    for(size_t i = 0; i < sockets.size(); ++i){
+        pollSet[i].fd = sockets[i].sock;
+        pollSet[i].events = POLLIN;
+        pollSet[i].revents = 0;
     }
 
-    //  Configure socket settings such that we spend at most 1 second listening for a response
-    #ifdef _WIN32
-        DWORD timeout = 1000;  // DWORD is basically Windows specific unsigned int!
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));  // can add a check to see if this fails!
-    #else
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    #endif
+    bool finished = false;
+    while(!finished){
+        auto now = Clock::now();
+        if(now >= deadline) {break;}
+        if(roundsLeft > 0 && now >= nextProbe){
+            sendRound();
+            --roundsLeft;
+            nextProbe = now + schedule.interval + std::chrono::milliseconds(jitter(random));
+        }
 
-    //  Set up variables to receive a response
-    std::vector<json> devices;
-    const size_t buffer_size = 4096;
-    char buffer[buffer_size]; //  buffer that is 4096 bytes long (sizeof(char) -> 1 byte)
-    
-    struct sockaddr_in senderAddr;
-    socklen_t senderAddrSize = sizeof(senderAddr);
+        //  Wake up for whichever comes first: deadline, next retransmit, end of the quiet window
+        auto wakeAt = deadline;
+        if(roundsLeft > 0 && nextProbe < wakeAt) {wakeAt = nextProbe;}
+        if(schedule.adaptive && roundsLeft == 0 && !rtts.empty()){
+            std::chrono::microseconds quiet = std::chrono::duration_cast<std::chrono::microseconds>(medianOf(rtts) * schedule.quietFactor);
+            if(quiet < schedule.minQuiet) {quiet = schedule.minQuiet;}
+            auto quietEnd = (std::max)(lastNewDevice, stats.probes.back().sentAt) + quiet;
+            if(now >= quietEnd){
+                stats.stoppedEarly = true;
+                break;
+            }
+            if(quietEnd < wakeAt) {wakeAt = quietEnd;}
+        }
 
-    //  Loop to listen to a response!
-    while(true){
-        int bytesReceived = recvfrom(sock, buffer, buffer_size, 0, (struct sockaddr*)&senderAddr, &senderAddrSize);
-        if(bytesReceived == SOCKET_ERROR){
+        long long waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - now).count() + 1;
+        int ready = pollSockets(pollSet.data(), (unsigned long)pollSet.size(), (int)waitMs);
+        if(ready == 0) {continue;}  //  time for the next step of the schedule
+        if(ready == SOCKET_ERROR){
             #ifdef _WIN32
-                if(WSAGetLastError() == WSAETIMEDOUT) {break;}
-                printf("Error receiving data: %ld\n", WSAGetLastError());
+                printf("Error waiting for data: %ld\n", WSAGetLastError());
             #else
-                if(errno == EAGAIN || errno == EWOULDBLOCK) {break;}
-                printf("Error receiving data. Errno %d: %s\n", errno, strerror(errno));
+                if(errno == EINTR) {continue;}
+                printf("Error waiting for data. Errno %d: %s\n", errno, strerror(errno));
             #endif
+            break;
         }
 
-        // Set message endpoint to the null terminator
-        buffer[bytesReceived] = '\0';
+        for(size_t i = 0; i < pollSet.size() && !finished; ++i){
+            if(!(pollSet[i].revents & POLLIN)) {continue;}
+
+            int received = receiveBatch(sockets[i], ring);
+            auto arrival = Clock::now();
+            //  We cannot tell which round a reply answers, so the RTT is measured from the latest one
+            ProbeStats& round = stats.probes.back();
+            std::chrono::microseconds rtt = std::chrono::duration_cast<std::chrono::microseconds>(arrival - round.sentAt);
+            for(int n = 0; n < received && !finished; ++n){
+                ++stats.datagrams;
+                if(round.replies++ == 0) {round.firstReplyRtt = rtt;}
+                rtts.push_back(rtt);
 
-        // Parse the message on the buffer using JSON parse. Check if message is valid.
-        try{
-            json description = json::parse(buffer);
-            if(description.contains("Identifier") && description["Identifier"]=="Topas4"){
-                devices.push_back(description);
+                json description;
+                if(!acceptReply(ring.buffers[n], ring.lengths[n], seenGUIDS, description)){
+                    ++stats.duplicates;
+                    continue;
+                }
+                ++round.newDevices;
+                lastNewDevice = arrival;
+                uniqueDevices.push_back(description);
+                rememberDevice(description);
+                if(done && done(description)) {finished = true;}
             }
-        } catch (const json::parse_error& err){
-            std::cerr << "(JSON) Bad data received by locator: " << err.what() << std::endl;
         }
     }
 
-    closesocket(sock);
+    for(const auto& probe : sockets) {closesocket(probe.sock);}
+
+    stats.medianRtt = medianOf(rtts);
+    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        m_lastStats = stats;
+    }
+    return uniqueDevices;
+}
+
+//  Expands "a.b.c.d/n" to its host addresses (without network and broadcast address for n < 31) and
+//  "a.b.c.d" to itself. Returns false for anything it cannot parse or for ranges larger than a /16.
+bool TopasLocator::expandTarget(const std::string& target, std::vector<uint32_t>& hosts){
+    std::string address = target;
+    int prefix = 32;
+    size_t slash = target.find('/');
+    if(slash != std::string::npos){
+        address = target.substr(0, slash);
+        char* end = nullptr;
+        prefix = (int)strtol(target.c_str() + slash + 1, &end, 10);
+        if(end == target.c_str() + slash + 1 || *end != '\0' || prefix < 16 || prefix > 32) {return false;}
+    }
+
+    struct in_addr parsed;
+    if(inet_pton(AF_INET, address.c_str(), &parsed) != 1) {return false;}
+    uint32_t base = ntohl(parsed.s_addr);
+    uint32_t mask = 0xFFFFFFFFu << (32 - prefix);
+    uint32_t first = base & mask;
+    uint32_t last = first | ~mask;
+    if(prefix < 31){
+        ++first;
+        --last;
+    }
+    for(uint64_t host = first; host <= last; ++host) {hosts.push_back((uint32_t)host);}
+    return true;
+}
+
+//  Unicast "Topas4?" to every host of targets, for networks that drop multicast. One non-blocking socket sends
+//  at most options.burst probes per step and options.packetsPerSecond overall, while the same poll loop collects
+//  the replies. Everything shares a single deadline.
+std::vector<json> TopasLocator::sweep(const std::vector<std::string>& targets, const SweepOptions& options){
+    typedef std::chrono::steady_clock Clock;
+    std::vector<uint32_t> hosts;
+    for(const auto& target : targets){
+        if(!expandTarget(target, hosts)) {std::cerr << "[WARNING] Ignoring sweep target " << target << std::endl;}
+    }
+    if(hosts.empty()) {return {};}
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock == INVALID_SOCKET){
+        #ifdef _WIN32
+            printf("Socket creation failed with error %ld. Returning empty vector\n", WSAGetLastError());
+        #else
+            printf("Socket creation failed with error %d: %s. Returning empty vector\n", errno, strerror(errno));
+        #endif
+        return {};
+    }
+    #ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+    #else
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+
+    ProbeSocket probe;
+    probe.sock = sock;
+    probe.name = "sweep";
+    probe.loopback = false;
+
+    static const std::string message = "Topas4?";
+    struct sockaddr_in targetAddr;
+    memset(&targetAddr, 0, sizeof(targetAddr));
+    targetAddr.sin_family = AF_INET;
+    targetAddr.sin_port = htons(7415);
 
-    //  Remove duplicate devices
     std::vector<json> uniqueDevices;
-    std::set<std::string> seenGUIDS;
-
-    for (const auto& device : devices){
-        if(device.contains("SenderGUID")){
-            std::string guid = device["SenderGUID"];
-            if(seenGUIDS.find(guid) == seenGUIDS.end()){
-                seenGUIDS.insert(guid);
-                uniqueDevices.push_back(device);
+    std::unordered_set<std::string> seenGUIDS;
+    static thread_local ReceiveRing ring;
+
+    auto start = Clock::now();
+    auto deadline = start + options.timeout;
+    size_t nextHost = 0;
+    size_t sendBudget = 0;  //  probes we may still send in the current step
+    auto nextStep = start;
+    std::chrono::microseconds stepLength(options.packetsPerSecond > 0 ? (long long)(options.burst * 1000000.0 / options.packetsPerSecond) : 0);
+
+    while(true){
+        auto now = Clock::now();
+        if(now >= deadline) {break;}
+
+        //  Refill the budget once per step, which keeps the rate at packetsPerSecond
+        if(nextHost < hosts.size() && now >= nextStep){
+            sendBudget = options.burst;
+            nextStep = now + stepLength;
+        }
+
+        bool blocked = false;
+        while(nextHost < hosts.size() && sendBudget > 0){
+            targetAddr.sin_addr.s_addr = htonl(hosts[nextHost]);
+            int send_result = sendto(sock, message.c_str(), (int)message.length(), 0, (struct sockaddr*)&targetAddr, sizeof(targetAddr));
+            if(send_result == SOCKET_ERROR){
+                #ifdef _WIN32
+                    if(WSAGetLastError() == WSAEWOULDBLOCK) {blocked = true; break;}
+                #else
+                    if(errno == EAGAIN || errno == EWOULDBLOCK) {blocked = true; break;}
+                #endif
+                //  e.g. no route to this host, skip it
             }
+            ++nextHost;
+            --sendBudget;
+        }
+
+        //  Wait for replies, for the socket to accept more probes, or for the next step
+        auto wakeAt = deadline;
+        if(nextHost < hosts.size() && !blocked && nextStep < wakeAt) {wakeAt = nextStep;}
+        struct pollfd pollEntry;
+        pollEntry.fd = sock;
+        pollEntry.events = POLLIN | (blocked ? POLLOUT : 0);
+        pollEntry.revents = 0;
+        long long waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - Clock::now()).count();
+        int ready = pollSockets(&pollEntry, 1, (int)(waitMs > 0 ? waitMs : 0));
+        if(ready == SOCKET_ERROR){
+            #ifndef _WIN32
+                if(errno == EINTR) {continue;}
+            #endif
+            break;
+        }
+        if(ready == 0 || !(pollEntry.revents & POLLIN)) {continue;}
+
+        int received = receiveBatch(probe, ring);
+        for(int n = 0; n < received; ++n){
+            json description;
+            if(!acceptReply(ring.buffers[n], ring.lengths[n], seenGUIDS, description)) {continue;}
+            uniqueDevices.push_back(description);
+            rememberDevice(description);
         }
     }
 
+    closesocket(sock);
     return uniqueDevices;
 }
-
@@ -5,8 +5,18 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <unordered_set>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <random>
+#include <algorithm>
 #include <cstring>
 #include <sys/types.h>
+#include <memory>
 #include <nlohmann/json.hpp> // Using nlohmann/json library for JSON parsing
 
 #ifdef _WIN32
@@ -19,6 +29,9 @@
     #include <arpa/inet.h>
     #include <unistd.h>
     #include <fcntl.h>
+    #include <poll.h>
+    #include <net/if.h>
+    #include <ifaddrs.h>
     typedef int SOCKET;
     #define SOCKET_ERROR -1
     #define INVALID_SOCKET -1
@@ -28,12 +41,142 @@
 
 using json = nlohmann::json;
 
+class TopasDiscoveryCache;
+
 class TopasLocator {
 public:
+    //  One entry of the discovery service registry, keyed by SenderGUID
+    struct DeviceRecord{
+        std::string guid;
+        std::string serialNumber;
+        std::string restUrl;  //  PublicApiRestUrl_Version0
+        json description;
+        std::chrono::steady_clock::time_point lastSeen;
+    };
+
+    enum class DeviceEvent{
+        APPEARED,
+        DISAPPEARED,
+        URL_CHANGED
+    };
+
+    //  When probes are sent during one discovery. The first round goes out right away, then retransmits rounds
+    //  follow every interval (+ random jitter up to jitter). With adaptive set, listening stops early once all
+    //  rounds are out and no new device answered for quietFactor x the median reply RTT (at least minQuiet).
+    struct ProbeSchedule{
+        int retransmits;
+        std::chrono::milliseconds interval;
+        std::chrono::milliseconds jitter;
+        bool adaptive;
+        double quietFactor;
+        std::chrono::microseconds minQuiet;
+    };
+
+    struct ProbeStats{
+        std::chrono::steady_clock::time_point sentAt;
+        int replies;  //  datagrams received while this was the latest round
+        int newDevices;
+        std::chrono::microseconds firstReplyRtt;
+    };
+
+    struct DiscoveryStats{
+        std::vector<ProbeStats> probes;
+        size_t datagrams;
+        size_t duplicates;
+        std::chrono::microseconds medianRtt;
+        std::chrono::milliseconds elapsed;
+        bool stoppedEarly;  //  true if the adaptive window ended the discovery before the deadline
+    };
+
+    //  Unicast sweep settings. burst probes are sent back to back, at most packetsPerSecond overall.
+    struct SweepOptions{
+        std::chrono::milliseconds timeout;
+        size_t packetsPerSecond;
+        size_t burst;
+        SweepOptions() : timeout(1000), packetsPerSecond(5000), burst(64) {}
+    };
+
+    //  Called from the service thread, so keep it short
+    typedef std::function<void(DeviceEvent event, const DeviceRecord& device)> DeviceEventCallback;
+
     TopasLocator();
     ~TopasLocator();
     
-    std::vector<json> locate();
+    //  Listens until timeout has passed, or returns early once expectedCount distinct devices answered (0 = no limit)
+    std::vector<json> locate(std::chrono::milliseconds timeout = std::chrono::milliseconds(1000), size_t expectedCount = 0);
+    //  Returns the description of the device with this serial number the moment it answers, or an empty json
+    json locateSerial(const std::string& serialNum, std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
+
+    void setProbeSchedule(const ProbeSchedule& schedule);
+    ProbeSchedule probeSchedule() const;
+    DiscoveryStats lastDiscoveryStats() const;  //  of the most recent locate()/locateSerial()/service round
+
+    //  For networks that drop multicast: sends the probe to every host of targets ("10.1.0.0/22" or "10.1.0.5")
+    std::vector<json> sweep(const std::vector<std::string>& targets, const SweepOptions& options = SweepOptions());
+
+    //  Every device found from now on is recorded in cache (serial number -> REST URL)
+    void setCache(const std::shared_ptr<TopasDiscoveryCache>& cache);
+
+    //  Discovery service: re-probes every period on a background thread and keeps a registry of the devices seen.
+    //  A device that has not answered for expireAfter is removed (DISAPPEARED).
+    void startService(std::chrono::milliseconds period = std::chrono::seconds(5), std::chrono::milliseconds expireAfter = std::chrono::seconds(20));
+    void stopService();
+    bool isServiceRunning() const;
+    bool hasCompletedRound() const;  //  true once the service finished at least one discovery round
+    std::vector<DeviceRecord> devices() const;
+    bool findBySerial(const std::string& serialNum, DeviceRecord& found) const;
+    int onDeviceEvent(const DeviceEventCallback& callback);  //  returns an id for removeDeviceEventCallback()
+    void removeDeviceEventCallback(int id);  //  once it returns, the callback is not running and will not be called again
+
+    //  The per-datagram step of discovery: true for a Topas4 reply from a device not in seenGUIDS yet (which is then
+    //  added), with its parsed description. Repeats are rejected from a scan of the raw bytes, without parsing.
+    static bool acceptReply(const char* data, size_t length, std::unordered_set<std::string>& seenGUIDS, json& description);
+
+private:
+    //  Sends the probes and collects unique device descriptions until timeout, or until done returns true for one
+    typedef std::function<bool(const json& device)> StopCondition;
+    std::vector<json> discover(std::chrono::milliseconds timeout, const StopCondition& done);
+
+    struct ProbeSocket{
+        SOCKET sock;
+        std::string name;  //  interface name, for error messages
+        bool loopback;
+    };
+    std::vector<ProbeSocket> openProbeSockets() const;
+    void sendProbe(const ProbeSocket& probe, const struct sockaddr_in& address) const;
+
+    //  Reusable receive buffers for one batch of datagrams
+    static const size_t RING_SIZE = 16;
+    static const size_t RECEIVE_BUFFER_SIZE = 4096;
+    struct ReceiveRing{
+        char buffers[RING_SIZE][RECEIVE_BUFFER_SIZE];
+        size_t lengths[RING_SIZE];
+    };
+    static bool expandTarget(const std::string& target, std::vector<uint32_t>& hosts);
+    void rememberDevice(const json& description) const;
+    int receiveBatch(const ProbeSocket& probe, ReceiveRing& ring) const;
+
+    void runService(std::chrono::milliseconds period, std::chrono::milliseconds expireAfter);
+    void updateRegistry(const std::vector<json>& found, std::chrono::milliseconds expireAfter);
+    void raise(DeviceEvent event, const DeviceRecord& device);
+
+    std::shared_ptr<TopasDiscoveryCache> m_cache;
+
+    mutable std::mutex m_statsMutex;  //  guards the schedule and the stats
+    ProbeSchedule m_schedule;
+    DiscoveryStats m_lastStats;
+
+    mutable std::mutex m_registryMutex;
+    std::map<std::string, DeviceRecord> m_registry;
+    bool m_completedRound;
+    std::map<int, DeviceEventCallback> m_callbacks;
+    int m_nextCallbackId;
+    std::recursive_mutex m_dispatchMutex;  //  held while callbacks are called
+
+    std::thread m_serviceThread;
+    std::mutex m_serviceMutex;
+    std::condition_variable m_serviceWake;
+    bool m_serviceStop;
 };
 
 
@@ -0,0 +1,96 @@
+#include "TopasOperation.hh"
+#include <iostream>
+
+std::string TopasOperation::StatusToString(Status status){
+    switch(status){
+        case(Status::PENDING): return "PENDING";
+        case(Status::SUCCEEDED): return "SUCCEEDED";
+        case(Status::FAILED): return "FAILED";
+        case(Status::TIMED_OUT): return "TIMED_OUT";
+        case(Status::CANCELLED): return "CANCELLED";
+        default: return "UNKNOWN";
+    }
+}
+
+TopasOperation::TopasOperation() : m_state{std::make_shared<State>()} {
+    m_state->finished = false;
+    m_state->result.status = Status::PENDING;
+    m_state->result.value = -1;
+}
+
+TopasOperation::Status TopasOperation::poll() const {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->result.status;
+}
+
+bool TopasOperation::isDone() const {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->finished;
+}
+
+TopasOperation::Result TopasOperation::wait() const {
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    m_state->done.wait(lock, [this]{ return m_state->finished; });
+    return m_state->result;
+}
+
+bool TopasOperation::wait_for(std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    return m_state->done.wait_for(lock, timeout, [this]{ return m_state->finished; });
+}
+
+void TopasOperation::onComplete(const CompletionCallback& callback) const {
+    if(!callback) {return;}
+    Result result;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if(!m_state->finished){
+            m_state->callbacks.push_back(callback);
+            return;
+        }
+        result = m_state->result;
+    }
+    callback(result);
+}
+
+void TopasOperation::cancel() const {
+    std::function<void()> onCancel;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if(m_state->finished) {return;}
+        onCancel = m_state->onCancel;
+    }
+    //  The worker notices the cancellation and finishes the operation as CANCELLED
+    if(onCancel) {onCancel();}
+    else {complete(Status::CANCELLED, "Cancelled");}
+}
+
+void TopasOperation::setCancelHandler(const std::function<void()>& onCancel) const {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->onCancel = onCancel;
+}
+
+void TopasOperation::complete(Status status, const std::string& message, float value) const {
+    std::vector<CompletionCallback> callbacks;
+    Result result;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if(m_state->finished) {return;}
+        m_state->finished = true;
+        m_state->result.status = status;
+        m_state->result.message = message;
+        m_state->result.value = value;
+        m_state->onCancel = std::function<void()>();
+        callbacks.swap(m_state->callbacks);
+        result = m_state->result;
+    }
+    m_state->done.notify_all();
+
+    for(const auto& callback : callbacks){
+        try{
+            callback(result);
+        } catch(const std::exception& e){
+            std::cerr << "[WARNING] Exception in operation completion callback: " << e.what() << std::endl;
+        }
+    }
+}
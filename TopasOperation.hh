@@ -0,0 +1,65 @@
+#ifndef TOPASOPERATION_HH
+#define TOPASOPERATION_HH
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+//  Handle to a device command (wavelength move, shutter toggle) running in the background.
+//  Copies share the same operation, so the handle can be passed around freely.
+class TopasOperation{
+public:
+    enum class Status{
+        PENDING,
+        SUCCEEDED,
+        FAILED,
+        TIMED_OUT,
+        CANCELLED
+    };
+
+    //  Final, verified outcome. value is the read back wavelength (nm) or shutter state (1/0), -1 if unknown.
+    struct Result{
+        Status status;
+        std::string message;
+        float value;
+    };
+
+    //  Runs once when the operation finishes, on the thread that finished it (or right away if it already has)
+    typedef std::function<void(const Result&)> CompletionCallback;
+
+    static std::string StatusToString(Status status);
+
+    TopasOperation();
+
+    Status poll() const;  //  never blocks
+    bool isDone() const;
+    Result wait() const;
+    bool wait_for(std::chrono::milliseconds timeout) const;  //  true if the operation finished in time
+    void onComplete(const CompletionCallback& callback) const;
+    void cancel() const;
+
+private:
+    friend class TopasDevice;
+    friend class TopasCommandQueue;
+
+    struct State{
+        std::mutex mutex;
+        std::condition_variable done;
+        bool finished;
+        Result result;
+        std::vector<CompletionCallback> callbacks;
+        std::function<void()> onCancel;
+    };
+    std::shared_ptr<State> m_state;
+
+    //  Used by the device to report the outcome. Only the first call has any effect.
+    void complete(Status status, const std::string& message, float value = -1) const;
+    void setCancelHandler(const std::function<void()>& onCancel) const;
+};
+
+
+#endif
@@ -0,0 +1,103 @@
+#include "TopasRequestEngine.hh"
+#include <iostream>
+
+TopasRequestEngine& TopasRequestEngine::instance(){
+    //  Function-local static, so the engine (and its thread) is only created when async requests are used
+    static TopasRequestEngine engine;
+    return engine;
+}
+
+TopasRequestEngine::TopasRequestEngine() : m_multi{nullptr}, m_stopRequested{false} {
+    if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK){
+        std::cerr << "[ERROR] Failed to initialize CURL for the request engine!" << std::endl;
+        return;
+    }
+    m_multi = curl_multi_init();
+    if(!m_multi){
+        std::cerr << "[ERROR] Failed to create CURL multi handle for the request engine!" << std::endl;
+        return;
+    }
+    m_thread = std::thread(&TopasRequestEngine::run, this);
+}
+
+TopasRequestEngine::~TopasRequestEngine(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopRequested = true;
+    }
+    if(m_multi) {curl_multi_wakeup(m_multi);}
+    if(m_thread.joinable()) {m_thread.join();}
+    if(m_multi) {curl_multi_cleanup(m_multi);}
+}
+
+bool TopasRequestEngine::submit(CURL* curl, const CompletionHandler& onDone){
+    if(!m_multi) {return false;}
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_stopRequested) {return false;}
+        m_incoming.push_back(std::make_pair(curl, onDone));
+    }
+    //  Kick the loop out of curl_multi_poll so it picks up the new transfer right away
+    curl_multi_wakeup(m_multi);
+    return true;
+}
+
+void TopasRequestEngine::run(){
+    std::vector<std::pair<CURL*, CompletionHandler> > incoming;
+    while(true){
+        bool stop = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            incoming.swap(m_incoming);
+            stop = m_stopRequested;
+        }
+
+        //  Add newly submitted transfers to the multi handle
+        for(auto& item : incoming){
+            CURLMcode mc = curl_multi_add_handle(m_multi, item.first);
+            if(mc != CURLM_OK){
+                std::cerr << "[ERROR] Request engine failed to add transfer: " << curl_multi_strerror(mc) << std::endl;
+                item.second(CURLE_FAILED_INIT);
+                continue;
+            }
+            m_inFlight[item.first] = item.second;
+        }
+        incoming.clear();
+
+        //  On shutdown, abort whatever is still running so the owners get their completion
+        if(stop){
+            for(auto& item : m_inFlight){
+                curl_multi_remove_handle(m_multi, item.first);
+                item.second(CURLE_ABORTED_BY_CALLBACK);
+            }
+            m_inFlight.clear();
+            return;
+        }
+
+        //  Drive all transfers, then hand out the ones that finished
+        int stillRunning = 0;
+        curl_multi_perform(m_multi, &stillRunning);
+
+        int msgsLeft = 0;
+        CURLMsg* msg = nullptr;
+        while((msg = curl_multi_info_read(m_multi, &msgsLeft))){
+            if(msg->msg != CURLMSG_DONE) {continue;}
+            CURL* curl = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(m_multi, curl);
+
+            auto it = m_inFlight.find(curl);
+            if(it == m_inFlight.end()) {continue;}
+            CompletionHandler onDone = it->second;
+            m_inFlight.erase(it);
+            try{
+                onDone(result);
+            } catch(const std::exception& e){
+                std::cerr << "[WARNING] Exception in async request completion handler: " << e.what() << std::endl;
+            }
+        }
+
+        //  Sleep until a socket is ready, a timeout is due, or submit() wakes us up
+        curl_multi_poll(m_multi, nullptr, 0, 1000, nullptr);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef TOPASREQUESTENGINE_HH
+#define TOPASREQUESTENGINE_HH
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <curl/curl.h>
+
+//  Process-wide event loop that drives asynchronous HTTP transfers with curl_multi.
+//  One background thread keeps every in-flight request (from any number of communicators/devices)
+//  moving, instead of each caller blocking inside curl_easy_perform.
+class TopasRequestEngine{
+public:
+    typedef std::function<void(CURLcode)> CompletionHandler;
+
+    static TopasRequestEngine& instance();
+    ~TopasRequestEngine();
+
+    //  Hands a fully configured easy handle to the event loop. onDone is called from the loop thread
+    //  once the transfer finishes, so it should be quick and must not block. Returns false if the engine is unusable.
+    bool submit(CURL* curl, const CompletionHandler& onDone);
+
+private:
+    TopasRequestEngine();
+    TopasRequestEngine(const TopasRequestEngine&) = delete;
+    TopasRequestEngine& operator=(const TopasRequestEngine&) = delete;
+
+    void run();
+
+    CURLM* m_multi;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    bool m_stopRequested;
+    std::vector<std::pair<CURL*, CompletionHandler> > m_incoming;  //  guarded by m_mutex
+    std::map<CURL*, CompletionHandler> m_inFlight;  //  only touched by the loop thread
+};
+
+
+#endif
@@ -0,0 +1,70 @@
+#include "TopasRequestPolicy.hh"
+#include <cstring>
+#include <random>
+#include <algorithm>
+
+TopasRequestPolicy::TopasRequestPolicy() : connectTimeoutMs{3000}, totalTimeoutMs{10000}, maxRetries{2}, initialBackoffMs{100}, maxBackoffMs{2000}, retryNonIdempotent{false} {
+
+}
+
+TopasRequestPolicy TopasRequestPolicy::noRetries(){
+    TopasRequestPolicy policy;
+    policy.maxRetries = 0;
+    return policy;
+}
+
+bool TopasRequestPolicy::isIdempotent(const char* method){
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0;
+}
+
+bool TopasRequestPolicy::shouldRetry(const char* method, CURLcode res, long httpResponseCode, int retry) const {
+    if(retry >= maxRetries) {return false;}
+
+    switch(res){
+        //  Nothing was sent, so even a PUT/POST can go again
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+            return true;
+        //  The request may have reached the device before things went wrong
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+            return isIdempotent(method) || retryNonIdempotent;
+        case CURLE_OK:
+            break;
+        default:
+            return false;  //  bad URL, response too large, aborted, ... would fail the same way again
+    }
+
+    //  Gateway and overload answers are worth another try, other HTTP errors are the caller's to handle
+    bool transient = httpResponseCode == 502 || httpResponseCode == 503 || httpResponseCode == 504;
+    return transient && (isIdempotent(method) || retryNonIdempotent);
+}
+
+long TopasRequestPolicy::backoffMs(int retry) const {
+    long backoff = initialBackoffMs;
+    for(int i = 0; i < retry && backoff < maxBackoffMs; ++i) {backoff *= 2;}
+    backoff = (std::min)(backoff, maxBackoffMs);
+    if(backoff <= 1) {return (std::max)(backoff, 0L);}
+
+    //  Half of it fixed, the other half random
+    static thread_local std::mt19937 random((unsigned)Clock::now().time_since_epoch().count());
+    std::uniform_int_distribution<long> jitter(0, backoff / 2);
+    return backoff - backoff / 2 + jitter(random);
+}
+
+long TopasRequestPolicy::remainingMs(Clock::time_point start) const {
+    if(totalTimeoutMs <= 0) {return 0;}
+    long elapsed = (long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+    long remaining = totalTimeoutMs - elapsed;
+    return remaining > 0 ? remaining : -1;
+}
+
+void TopasRequestPolicy::applyTimeouts(CURL* curl, long remainingMs) const {
+    long connectMs = connectTimeoutMs;
+    if(remainingMs > 0 && (connectMs <= 0 || connectMs > remainingMs)) {connectMs = remainingMs;}
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (std::max)(connectMs, 0L));
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (std::max)(remainingMs, 0L));
+}
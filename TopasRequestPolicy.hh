@@ -0,0 +1,46 @@
+#ifndef TOPASREQUESTPOLICY_HH
+#define TOPASREQUESTPOLICY_HH
+
+#include <chrono>
+#include <curl/curl.h>
+
+//  Deadlines and retry rules of a REST request. Every TopasCommunicator has one (setRequestPolicy) and the
+//  blocking calls also take one per call. totalTimeoutMs bounds the whole call, retries and backoff included,
+//  so a hung device can not block the caller for longer than that.
+//
+//  Only failures that look transient are retried (connection refused/reset, timeouts, empty replies,
+//  502/503/504), waiting a jittered, exponentially growing backoff in between. GETs are always safe to repeat.
+//  PUT and POST change the device state, so they are only replayed if retryNonIdempotent is set, unless the
+//  request never left this machine (the connection could not be made), in which case repeating it is harmless.
+struct TopasRequestPolicy{
+    typedef std::chrono::steady_clock Clock;
+
+    long connectTimeoutMs;  //  per attempt, to open the TCP connection
+    long totalTimeoutMs;  //  whole call including retries (0 = no deadline)
+    int maxRetries;  //  attempts after the first one
+    long initialBackoffMs;  //  wait before the first retry, doubled for each further one
+    long maxBackoffMs;
+    bool retryNonIdempotent;  //  caller knows that repeating its PUT/POST is harmless
+
+    //  3 s connect, 10 s total, 2 retries starting at 100 ms
+    TopasRequestPolicy();
+
+    //  Same deadlines, but a single attempt
+    static TopasRequestPolicy noRetries();
+
+    static bool isIdempotent(const char* method);
+
+    //  Whether the attempt that ended with res / httpResponseCode should be repeated (retry counts from 0)
+    bool shouldRetry(const char* method, CURLcode res, long httpResponseCode, int retry) const;
+    //  Wait before the given retry: between half and all of the exponential backoff, picked at random so clients
+    //  that failed together do not all come back at the same moment
+    long backoffMs(int retry) const;
+
+    //  Time left of the total deadline for a call started at start (0 = no deadline, negative = expired)
+    long remainingMs(Clock::time_point start) const;
+    //  Sets the attempt timeouts on curl, capped by remainingMs
+    void applyTimeouts(CURL* curl, long remainingMs) const;
+};
+
+
+#endif
@@ -0,0 +1,457 @@
+#include "TopasResponseDecoder.hh"
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace {
+    //  Minimal pull reader over a JSON text, just enough for the decoders below. It never allocates;
+    //  only readString writes into a caller owned string.
+    class JsonCursor{
+    public:
+        JsonCursor(const char* data, size_t length) : m_position(data), m_end(data + length) {}
+
+        void skipWhitespace(){
+            while(m_position < m_end && (*m_position == ' ' || *m_position == '\t' || *m_position == '\n' || *m_position == '\r')) {++m_position;}
+        }
+
+        bool consume(char expected){
+            skipWhitespace();
+            if(m_position == m_end || *m_position != expected) {return false;}
+            ++m_position;
+            return true;
+        }
+
+        bool peek(char expected){
+            skipWhitespace();
+            return m_position != m_end && *m_position == expected;
+        }
+
+        bool peekNumber(){
+            skipWhitespace();
+            return m_position != m_end && (*m_position == '-' || isDigit(*m_position));
+        }
+
+        bool atEnd(){
+            skipWhitespace();
+            return m_position == m_end;
+        }
+
+        //  The bytes between the quotes, still escaped. escaped tells if there are any backslashes in them.
+        bool readRawString(const char*& start, size_t& length, bool& escaped){
+            if(!consume('"')) {return false;}
+            start = m_position;
+            escaped = false;
+            while(m_position < m_end && *m_position != '"'){
+                if(*m_position == '\\'){
+                    escaped = true;
+                    if(++m_position == m_end) {return false;}
+                }
+                ++m_position;
+            }
+            if(m_position == m_end) {return false;}
+            length = m_position - start;
+            ++m_position;
+            return true;
+        }
+
+        bool readString(std::string& output){
+            const char* start;
+            size_t length;
+            bool escaped;
+            if(!readRawString(start, length, escaped)) {return false;}
+            if(!escaped){
+                output.assign(start, length);
+                return true;
+            }
+            return unescape(start, start + length, output);
+        }
+
+        bool readNumber(double& value){
+            skipWhitespace();
+            const char* p = m_position;
+            bool negative = (p < m_end && *p == '-');
+            if(negative) {++p;}
+            if(p == m_end || !isDigit(*p)) {return false;}
+
+            //  Up to 19 significant digits in an integer mantissa, the rest only moves the exponent
+            uint64_t mantissa = 0;
+            int digits = 0;
+            int exponent = 0;
+            for(; p < m_end && isDigit(*p); ++p){
+                if(digits < 19){
+                    mantissa = mantissa * 10 + (*p - '0');
+                    if(mantissa) {++digits;}
+                } else {
+                    ++exponent;
+                }
+            }
+            if(p < m_end && *p == '.'){
+                ++p;
+                if(p == m_end || !isDigit(*p)) {return false;}
+                for(; p < m_end && isDigit(*p); ++p){
+                    if(digits < 19){
+                        mantissa = mantissa * 10 + (*p - '0');
+                        if(mantissa) {++digits;}
+                        --exponent;
+                    }
+                }
+            }
+            if(p < m_end && (*p == 'e' || *p == 'E')){
+                ++p;
+                bool negativeExponent = (p < m_end && *p == '-');
+                if(p < m_end && (*p == '-' || *p == '+')) {++p;}
+                if(p == m_end || !isDigit(*p)) {return false;}
+                int written = 0;
+                for(; p < m_end && isDigit(*p); ++p){
+                    if(written < 100000) {written = written * 10 + (*p - '0');}
+                }
+                exponent += negativeExponent ? -written : written;
+            }
+
+            //  Dividing by an exact power of ten keeps values like 1300.5 exact
+            value = (exponent >= 0) ? (double)mantissa * std::pow(10.0, exponent) : (double)mantissa / std::pow(10.0, -exponent);
+            if(negative) {value = -value;}
+            m_position = p;
+            return true;
+        }
+
+        bool readBool(bool& value){
+            if(matchLiteral("true")){
+                value = true;
+                return true;
+            }
+            if(matchLiteral("false")){
+                value = false;
+                return true;
+            }
+            return false;
+        }
+
+        bool readNull(){
+            return matchLiteral("null");
+        }
+
+        //  Steps over one value of any type
+        bool skipValue(int depth = 0){
+            if(depth > 64) {return false;}
+            skipWhitespace();
+            if(m_position == m_end) {return false;}
+            switch(*m_position){
+                case '"': {
+                    const char* start;
+                    size_t length;
+                    bool escaped;
+                    return readRawString(start, length, escaped);
+                }
+                case '{': {
+                    ++m_position;
+                    if(consume('}')) {return true;}
+                    do{
+                        const char* start;
+                        size_t length;
+                        bool escaped;
+                        if(!readRawString(start, length, escaped) || !consume(':') || !skipValue(depth + 1)) {return false;}
+                    } while(consume(','));
+                    return consume('}');
+                }
+                case '[': {
+                    ++m_position;
+                    if(consume(']')) {return true;}
+                    do{
+                        if(!skipValue(depth + 1)) {return false;}
+                    } while(consume(','));
+                    return consume(']');
+                }
+                case 't':
+                case 'f': {
+                    bool ignored;
+                    return readBool(ignored);
+                }
+                case 'n':
+                    return readNull();
+                default: {
+                    double ignored;
+                    return readNumber(ignored);
+                }
+            }
+        }
+
+    private:
+        const char* m_position;
+        const char* m_end;
+
+        static bool isDigit(char c) {return c >= '0' && c <= '9';}
+
+        bool matchLiteral(const char* literal){
+            skipWhitespace();
+            size_t length = strlen(literal);
+            if((size_t)(m_end - m_position) < length || memcmp(m_position, literal, length) != 0) {return false;}
+            m_position += length;
+            return true;
+        }
+
+        static bool readHex4(const char* p, const char* end, unsigned& code){
+            if(end - p < 4) {return false;}
+            code = 0;
+            for(int i = 0; i < 4; ++i){
+                char c = p[i];
+                code <<= 4;
+                if(c >= '0' && c <= '9') {code |= c - '0';}
+                else if(c >= 'a' && c <= 'f') {code |= c - 'a' + 10;}
+                else if(c >= 'A' && c <= 'F') {code |= c - 'A' + 10;}
+                else {return false;}
+            }
+            return true;
+        }
+
+        static void appendUtf8(std::string& output, unsigned code){
+            if(code < 0x80){
+                output.push_back((char)code);
+            } else if(code < 0x800){
+                output.push_back((char)(0xC0 | (code >> 6)));
+                output.push_back((char)(0x80 | (code & 0x3F)));
+            } else if(code < 0x10000){
+                output.push_back((char)(0xE0 | (code >> 12)));
+                output.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+                output.push_back((char)(0x80 | (code & 0x3F)));
+            } else {
+                output.push_back((char)(0xF0 | (code >> 18)));
+                output.push_back((char)(0x80 | ((code >> 12) & 0x3F)));
+                output.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+                output.push_back((char)(0x80 | (code & 0x3F)));
+            }
+        }
+
+        static bool unescape(const char* p, const char* end, std::string& output){
+            output.clear();
+            for(; p < end; ++p){
+                if(*p != '\\'){
+                    output.push_back(*p);
+                    continue;
+                }
+                ++p;
+                switch(*p){
+                    case 'b': output.push_back('\b'); break;
+                    case 'f': output.push_back('\f'); break;
+                    case 'n': output.push_back('\n'); break;
+                    case 'r': output.push_back('\r'); break;
+                    case 't': output.push_back('\t'); break;
+                    case 'u': {
+                        unsigned code;
+                        if(!readHex4(p + 1, end, code)) {return false;}
+                        p += 4;
+                        //  a high surrogate must be followed by an escaped low surrogate
+                        if(code >= 0xD800 && code <= 0xDBFF){
+                            unsigned low;
+                            if(end - p < 7 || p[1] != '\\' || p[2] != 'u' || !readHex4(p + 3, end, low) || low < 0xDC00 || low > 0xDFFF) {return false;}
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                            p += 6;
+                        }
+                        appendUtf8(output, code);
+                        break;
+                    }
+                    default: output.push_back(*p); break;  //  \" \\ and \/
+                }
+            }
+            return true;
+        }
+    };
+
+    //  What a field reader did with the value it was given
+    enum class FieldResult{
+        READ,  //  stored in the target
+        SKIPPED,  //  valid JSON but not the expected type (e.g. null), left the target alone
+        FAILED  //  malformed JSON, decoding stops
+    };
+
+    //  One row of a document's field table: the JSON member name and how to read its value into Target
+    template<typename Target>
+    struct FieldEntry{
+        const char* name;
+        FieldResult (*read)(JsonCursor& cursor, Target& target);
+    };
+
+    //  Reads one JSON object into target using its field table. Members that are not in the table are skipped.
+    //  present[i] is set for every table entry that was READ (present may be null).
+    template<typename Target, size_t N>
+    bool readObject(JsonCursor& cursor, const FieldEntry<Target> (&table)[N], Target& target, bool* present){
+        if(present) {std::fill(present, present + N, false);}
+        if(!cursor.consume('{')) {return false;}
+        if(cursor.consume('}')) {return true;}
+        do{
+            const char* key;
+            size_t keyLength;
+            bool escaped;
+            if(!cursor.readRawString(key, keyLength, escaped) || !cursor.consume(':')) {return false;}
+
+            size_t field = N;
+            for(size_t i = 0; i < N && !escaped; ++i){
+                if(strlen(table[i].name) == keyLength && memcmp(table[i].name, key, keyLength) == 0){
+                    field = i;
+                    break;
+                }
+            }
+            if(field == N){
+                if(!cursor.skipValue()) {return false;}
+                continue;
+            }
+
+            FieldResult result = table[field].read(cursor, target);
+            if(result == FieldResult::FAILED) {return false;}
+            if(present && result == FieldResult::READ) {present[field] = true;}
+        } while(cursor.consume(','));
+        return cursor.consume('}');
+    }
+
+    //  Generic value readers, shared by the field tables
+    FieldResult readFloat(JsonCursor& cursor, float& value){
+        if(!cursor.peekNumber()) {return cursor.skipValue() ? FieldResult::SKIPPED : FieldResult::FAILED;}
+        double number;
+        if(!cursor.readNumber(number)) {return FieldResult::FAILED;}
+        value = (float)number;
+        return FieldResult::READ;
+    }
+
+    FieldResult readBool(JsonCursor& cursor, bool& value){
+        if(!cursor.peek('t') && !cursor.peek('f')) {return cursor.skipValue() ? FieldResult::SKIPPED : FieldResult::FAILED;}
+        return cursor.readBool(value) ? FieldResult::READ : FieldResult::FAILED;
+    }
+
+    FieldResult readString(JsonCursor& cursor, std::string& value){
+        if(!cursor.peek('"')) {return cursor.skipValue() ? FieldResult::SKIPPED : FieldResult::FAILED;}
+        return cursor.readString(value) ? FieldResult::READ : FieldResult::FAILED;
+    }
+
+    //  Messages: [{"Text": "...", "Image": null or "..."}]
+    const FieldEntry<UserActionMessage> MESSAGE_FIELDS[] = {
+        {"Text", [](JsonCursor& c, UserActionMessage& m) -> FieldResult {return readString(c, m.text);}},
+        {"Image", [](JsonCursor& c, UserActionMessage& m) -> FieldResult {return readString(c, m.image);}}
+    };
+
+    FieldResult readMessages(JsonCursor& cursor, WavelengthOutput& output){
+        if(!cursor.peek('[')) {return cursor.skipValue() ? FieldResult::SKIPPED : FieldResult::FAILED;}
+        cursor.consume('[');
+        size_t count = 0;
+        if(!cursor.consume(']')){
+            do{
+                //  reuse the entries (and their strings) from the previous decode
+                if(count == output.messages.size()) {output.messages.push_back(UserActionMessage());}
+                UserActionMessage& message = output.messages[count++];
+                message.text.clear();
+                message.image.clear();
+                if(!readObject(cursor, MESSAGE_FIELDS, message, nullptr)) {return FieldResult::FAILED;}
+            } while(cursor.consume(','));
+            if(!cursor.consume(']')) {return FieldResult::FAILED;}
+        }
+        output.messages.resize(count);
+        return FieldResult::READ;
+    }
+
+    //  Row of each field in WAVELENGTH_OUTPUT_FIELDS (and so in its present[] flags), in table order
+    enum WavelengthOutputField{
+        OUTPUT_WAVELENGTH,
+        OUTPUT_INTERACTION,
+        OUTPUT_IN_PROGRESS,
+        OUTPUT_COMPLETION_PART,
+        OUTPUT_WAITING_FOR_USER,
+        OUTPUT_MESSAGES,
+        OUTPUT_FIELD_COUNT
+    };
+
+    const FieldEntry<WavelengthOutput> WAVELENGTH_OUTPUT_FIELDS[] = {
+        {"Wavelength", [](JsonCursor& c, WavelengthOutput& o) -> FieldResult {return readFloat(c, o.wavelength);}},
+        {"Interaction", [](JsonCursor& c, WavelengthOutput& o) -> FieldResult {return readString(c, o.interaction);}},
+        {"IsWavelengthSettingInProgress", [](JsonCursor& c, WavelengthOutput& o) -> FieldResult {return readBool(c, o.isWavelengthSettingInProgress);}},
+        {"WavelengthSettingCompletionPart", [](JsonCursor& c, WavelengthOutput& o) -> FieldResult {return readFloat(c, o.wavelengthSettingCompletionPart);}},
+        {"IsWaitingForUserAction", [](JsonCursor& c, WavelengthOutput& o) -> FieldResult {return readBool(c, o.isWaitingForUserAction);}},
+        {"Messages", readMessages}
+    };
+    static_assert(sizeof(WAVELENGTH_OUTPUT_FIELDS) / sizeof(WAVELENGTH_OUTPUT_FIELDS[0]) == OUTPUT_FIELD_COUNT, "WavelengthOutputField must list every row of WAVELENGTH_OUTPUT_FIELDS");
+
+    enum OutputRangeField{
+        RANGE_FROM,
+        RANGE_TO,
+        RANGE_FIELD_COUNT
+    };
+
+    const FieldEntry<InteractionRange> OUTPUT_RANGE_FIELDS[] = {
+        {"From", [](JsonCursor& c, InteractionRange& r) -> FieldResult {return readFloat(c, r.from);}},
+        {"To", [](JsonCursor& c, InteractionRange& r) -> FieldResult {return readFloat(c, r.to);}}
+    };
+    static_assert(sizeof(OUTPUT_RANGE_FIELDS) / sizeof(OUTPUT_RANGE_FIELDS[0]) == RANGE_FIELD_COUNT, "OutputRangeField must list every row of OUTPUT_RANGE_FIELDS");
+
+    FieldResult readOutputRange(JsonCursor& cursor, InteractionRange& range){
+        if(!cursor.peek('{')) {return cursor.skipValue() ? FieldResult::SKIPPED : FieldResult::FAILED;}
+        bool present[RANGE_FIELD_COUNT];
+        if(!readObject(cursor, OUTPUT_RANGE_FIELDS, range, present)) {return FieldResult::FAILED;}
+        return (present[RANGE_FROM] && present[RANGE_TO]) ? FieldResult::READ : FieldResult::SKIPPED;
+    }
+
+    enum InteractionField{
+        INTERACTION_TYPE,
+        INTERACTION_OUTPUT_RANGE,
+        INTERACTION_FIELD_COUNT
+    };
+
+    const FieldEntry<InteractionRange> INTERACTION_FIELDS[] = {
+        {"Type", [](JsonCursor& c, InteractionRange& r) -> FieldResult {return readString(c, r.type);}},
+        {"OutputRange", readOutputRange}
+    };
+    static_assert(sizeof(INTERACTION_FIELDS) / sizeof(INTERACTION_FIELDS[0]) == INTERACTION_FIELD_COUNT, "InteractionField must list every row of INTERACTION_FIELDS");
+}
+
+bool TopasResponseDecoder::decodeWavelengthOutput(const char* data, size_t length, WavelengthOutput& output){
+    output.interaction.clear();
+    output.wavelength = -1;
+    output.isWavelengthSettingInProgress = false;
+    output.wavelengthSettingCompletionPart = 0;
+    output.isWaitingForUserAction = false;
+
+    JsonCursor cursor(data, length);
+    bool present[OUTPUT_FIELD_COUNT];
+    bool parsed = readObject(cursor, WAVELENGTH_OUTPUT_FIELDS, output, present) && cursor.atEnd();
+    if(!parsed || !present[OUTPUT_MESSAGES]) {output.messages.clear();}  //  kept otherwise, so its entries are reused
+    return parsed && present[OUTPUT_WAVELENGTH];
+}
+
+bool TopasResponseDecoder::decodeShutterStatus(const char* data, size_t length, bool& isOpen){
+    JsonCursor cursor(data, length);
+    return cursor.readBool(isOpen) && cursor.atEnd();
+}
+
+bool TopasResponseDecoder::decodeInteractions(const char* data, size_t length, std::vector<InteractionRange>& interactions){
+    JsonCursor cursor(data, length);
+    size_t count = 0;
+    if(!cursor.consume('[')) {return false;}
+    if(!cursor.consume(']')){
+        do{
+            if(count == interactions.size()) {interactions.push_back(InteractionRange());}
+            InteractionRange& entry = interactions[count];
+            bool present[INTERACTION_FIELD_COUNT];
+            if(!readObject(cursor, INTERACTION_FIELDS, entry, present)) {
+                interactions.resize(count);
+                return false;
+            }
+            if(present[INTERACTION_TYPE] && present[INTERACTION_OUTPUT_RANGE]) {++count;}  //  otherwise the slot is reused by the next entry
+        } while(cursor.consume(','));
+        if(!cursor.consume(']')){
+            interactions.resize(count);
+            return false;
+        }
+    }
+    interactions.resize(count);
+    return cursor.atEnd();
+}
+
+bool TopasResponseDecoder::decodeWavelengthOutput(const std::string& body, WavelengthOutput& output){
+    return decodeWavelengthOutput(body.data(), body.size(), output);
+}
+
+bool TopasResponseDecoder::decodeShutterStatus(const std::string& body, bool& isOpen){
+    return decodeShutterStatus(body.data(), body.size(), isOpen);
+}
+
+bool TopasResponseDecoder::decodeInteractions(const std::string& body, std::vector<InteractionRange>& interactions){
+    return decodeInteractions(body.data(), body.size(), interactions);
+}
@@ -0,0 +1,45 @@
+#ifndef TOPASRESPONSEDECODER_HH
+#define TOPASRESPONSEDECODER_HH
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "TopasInteractionIndex.hh"
+
+//  One entry of the Messages list shown while a wavelength move waits for the user
+struct UserActionMessage{
+    std::string text;
+    std::string image;  //  empty if the device sent null
+};
+
+//  Typed copy of /Optical/WavelengthControl/Output
+struct WavelengthOutput{
+    std::string interaction;
+    float wavelength;
+    bool isWavelengthSettingInProgress;
+    float wavelengthSettingCompletionPart;
+    bool isWaitingForUserAction;
+    std::vector<UserActionMessage> messages;
+};
+
+//  Decodes the bodies of the frequently polled endpoints straight from the response bytes into the structs above,
+//  without building a json DOM. Every document is described by a table of the fields we read; anything else is
+//  skipped. The output's strings and vectors are reused, so repeated decodes into the same struct stop allocating
+//  once their capacity suffices. All functions return false (leaving the output partially filled) for a body that
+//  is not valid JSON or lacks a required field.
+class TopasResponseDecoder{
+public:
+    //  Requires "Wavelength"; the other fields default to empty/false/0 when missing
+    static bool decodeWavelengthOutput(const char* data, size_t length, WavelengthOutput& output);
+    //  /ShutterInterlock/IsShutterOpen is a bare true/false
+    static bool decodeShutterStatus(const char* data, size_t length, bool& isOpen);
+    //  /Optical/WavelengthControl/ExpandedInteractions, skipping entries without a string Type and a numeric OutputRange
+    static bool decodeInteractions(const char* data, size_t length, std::vector<InteractionRange>& interactions);
+
+    static bool decodeWavelengthOutput(const std::string& body, WavelengthOutput& output);
+    static bool decodeShutterStatus(const std::string& body, bool& isOpen);
+    static bool decodeInteractions(const std::string& body, std::vector<InteractionRange>& interactions);
+};
+
+
+#endif
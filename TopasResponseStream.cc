@@ -0,0 +1,114 @@
+#include "TopasResponseStream.hh"
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <new>
+
+TopasResponseStream::TopasResponseStream() : m_finished{false}, m_abandoned{false} {
+
+}
+
+bool TopasResponseStream::write(const char* data, size_t length){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_abandoned) {return false;}
+
+        //  Top up the newest chunk first, then continue in recycled (or new) chunk buffers
+        while(length > 0){
+            if(m_filled.empty() || m_filled.back().size() == CHUNK_SIZE){
+                if(m_spare.empty()){
+                    m_filled.push_back(std::vector<char>());
+                    m_filled.back().reserve(CHUNK_SIZE);
+                } else {
+                    m_filled.push_back(std::move(m_spare.back()));
+                    m_spare.pop_back();
+                }
+            }
+            std::vector<char>& chunk = m_filled.back();
+            size_t count = (std::min)(length, CHUNK_SIZE - chunk.size());
+            chunk.insert(chunk.end(), data, data + count);
+            data += count;
+            length -= count;
+        }
+    }
+    m_dataReady.notify_one();
+    return true;
+}
+
+void TopasResponseStream::finish(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+    }
+    m_dataReady.notify_all();
+}
+
+void TopasResponseStream::abandon(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_abandoned = true;
+    m_filled.clear();
+    setg(nullptr, nullptr, nullptr);
+}
+
+//  The current chunk is used up: recycle it and wait for the next one (or the end)
+TopasResponseStream::int_type TopasResponseStream::underflow(){
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(m_reading.capacity() > 0){
+        m_reading.clear();
+        m_spare.push_back(std::move(m_reading));
+        m_reading = std::vector<char>();
+    }
+
+    m_dataReady.wait(lock, [this]{ return !m_filled.empty() || m_finished || m_abandoned; });
+    if(m_filled.empty() || m_abandoned){
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+
+    m_reading = std::move(m_filled.front());
+    m_filled.pop_front();
+    char* begin = m_reading.data();
+    setg(begin, begin, begin + m_reading.size());
+    return traits_type::to_int_type(*begin);
+}
+
+TopasResponseSink::TopasResponseSink() : body{nullptr}, stream{nullptr}, maxSize{0}, received{0}, overflowed{false} {
+
+}
+
+TopasResponseSink::TopasResponseSink(std::string* bodyToFill, size_t maxSizeToAllow) : body{bodyToFill}, stream{nullptr}, maxSize{maxSizeToAllow}, received{0}, overflowed{false} {
+
+}
+
+TopasResponseSink::TopasResponseSink(TopasResponseStream* streamToFeed, size_t maxSizeToAllow) : body{nullptr}, stream{streamToFeed}, maxSize{maxSizeToAllow}, received{0}, overflowed{false} {
+
+}
+
+void TopasResponseSink::reset(){
+    received = 0;
+    overflowed = false;
+    if(body) {body->clear();}
+}
+
+size_t TopasResponseSink::write(char* contents, size_t size, size_t nmemb, void* userdata){
+    TopasResponseSink* sink = static_cast<TopasResponseSink*>(userdata);
+    size_t length = size * nmemb;
+
+    //  Stop runaway responses as soon as they cross the limit instead of buffering all of them
+    if(sink->maxSize > 0 && sink->received + length > sink->maxSize){
+        if(!sink->overflowed) {std::cerr << "[ERROR] Response larger than " << sink->maxSize << " bytes, aborting the transfer" << std::endl;}
+        sink->overflowed = true;
+        return 0;
+    }
+    sink->received += length;
+
+    if(sink->stream) {return sink->stream->write(contents, length) ? length : 0;}
+    if(!sink->body) {return length;}
+    try {
+        sink->body->append(contents, length);
+        return length;
+    } catch(std::bad_alloc& e) {
+        // Handle memory problem
+        return 0;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef TOPASRESPONSESTREAM_HH
+#define TOPASRESPONSESTREAM_HH
+
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+//  Hands a response body from the transfer thread to a parser on another thread while it is still arriving.
+//  The transfer side write()s chunks as CURL delivers them; the reading side is a std::streambuf, so it can be
+//  wrapped in a std::istream and given to json::parse, which blocks until more data or the end arrives.
+//  Consumed chunk buffers are kept and reused, so memory stays at a few chunks however large the body is
+//  as long as the parser keeps up. write() never blocks, though: it runs on the request engine thread, which
+//  other transfers share, so there is no backpressure and a slow reader lets chunks pile up. Memory is then only
+//  bounded by the sink's maxSize (TopasCommunicator::setMaxResponseSize), not by the chunk size.
+class TopasResponseStream : public std::streambuf{
+public:
+    static const size_t CHUNK_SIZE = 16384;
+
+    TopasResponseStream();
+
+    //  Transfer side. write() returns false once the reader has abandoned the stream, so the transfer can stop.
+    bool write(const char* data, size_t length);
+    void finish();  //  no more data, the reader sees end of file
+
+    //  Reading side: stop reading early (e.g. after a parse error). Pending and future data is dropped.
+    void abandon();
+
+protected:
+    int_type underflow() override;
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_dataReady;
+    std::deque<std::vector<char> > m_filled;  //  chunks waiting for the reader, oldest first
+    std::vector<std::vector<char> > m_spare;  //  consumed chunks, reused by write()
+    std::vector<char> m_reading;  //  chunk currently exposed as the get area
+    bool m_finished;
+    bool m_abandoned;
+};
+
+//  Destination of a CURL transfer's body (the CURLOPT_WRITEDATA of write()): appended to body, or passed on to
+//  stream as it arrives. A transfer that grows past maxSize (0 = no limit) is aborted by returning 0 to CURL.
+struct TopasResponseSink{
+    std::string* body;
+    TopasResponseStream* stream;
+    size_t maxSize;
+    size_t received;
+    bool overflowed;
+
+    TopasResponseSink();
+    TopasResponseSink(std::string* body, size_t maxSize);
+    TopasResponseSink(TopasResponseStream* stream, size_t maxSize);
+
+    void reset();  //  start over for a repeated transfer: empties body and the byte count
+
+    static size_t write(char* contents, size_t size, size_t nmemb, void* userdata);  //  CURLOPT_WRITEFUNCTION
+};
+
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TOPASSEQLOCK_HH
+#define TOPASSEQLOCK_HH
+
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+//  Single-writer sequence lock for small plain structs. The writer never waits and readers never block the
+//  writer: a reader simply retries if a write happened while it was copying. The payload is kept in relaxed
+//  atomic words, so a torn read is detected by the sequence check instead of being a data race.
+template <typename T>
+class TopasSeqLock{
+    static_assert(std::is_trivially_copyable<T>::value, "TopasSeqLock only holds trivially copyable types");
+public:
+    TopasSeqLock() : m_sequence{0} {
+        for(auto& word : m_words) {word.store(0, std::memory_order_relaxed);}
+    }
+
+    //  Only one thread may call store() at a time
+    void store(const T& value){
+        uint64_t buffer[WORDS] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+
+        unsigned sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);  //  odd: write in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        for(size_t i = 0; i < WORDS; ++i) {m_words[i].store(buffer[i], std::memory_order_relaxed);}
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    //  Returns false if nothing was stored yet
+    bool load(T& value) const {
+        uint64_t buffer[WORDS];
+        unsigned before, after;
+        do{
+            before = m_sequence.load(std::memory_order_acquire);
+            if(before & 1) {continue;}
+            for(size_t i = 0; i < WORDS; ++i) {buffer[i] = m_words[i].load(std::memory_order_relaxed);}
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_sequence.load(std::memory_order_relaxed);
+        } while((before & 1) || before != after);
+
+        if(before == 0) {return false;}
+        std::memcpy(&value, buffer, sizeof(T));
+        return true;
+    }
+
+private:
+    static const size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    std::atomic<unsigned> m_sequence;
+    std::atomic<uint64_t> m_words[WORDS];
+};
+
+
+#endif
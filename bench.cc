@@ -0,0 +1,371 @@
+//  Benchmarks for the hot paths of the library, to catch regressions when it is upgraded.
+//  Prints one JSON object per benchmark (one per line) with latency percentiles and heap allocations per operation:
+//      {"name":"...","iterations":N,"p50_ns":...,"p99_ns":...,"max_ns":...,"mean_ns":...,"allocs_per_op":...}
+//  Allocations are counted on the benchmarking thread only (background request/telemetry threads are not included),
+//  and only those made through operator new; libcurl's own malloc calls are not seen.
+//  Benchmarks of the steady-state polling path must not allocate at all; if one does, the exit status is 2.
+//
+//  The micro benchmarks run offline. The end-to-end ones need a REST server, e.g. topas4_mock_server:
+//      topas4_mock_server &
+//      topas4_bench --server http://127.0.0.1:8004/Sim-0001/v0/PublicAPI
+//
+//  usage: topas4_bench [options]
+//      --server URL        REST base address for the end-to-end benchmarks (default http://127.0.0.1:8004/Sim-0001/v0/PublicAPI)
+//      --iterations N      iterations of every micro benchmark (default 20000)
+//      --requests N        iterations of every end-to-end benchmark (default 2000)
+//      --filter TEXT       only run benchmarks whose name contains TEXT
+//      --output FILE       write the results to FILE instead of stdout
+
+#include <new>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include "TopasDevice.hh"
+
+//  Heap allocation counter. Replacing the global operator new is the only portable way to see
+//  allocations made inside the library and nlohmann/json.
+static thread_local unsigned long long t_allocations = 0;
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic ignored "-Wmismatched-new-delete"  //  GCC does not know operator new below is malloc
+#endif
+
+void* operator new(std::size_t size){
+    ++t_allocations;
+    void* memory = malloc(size ? size : 1);
+    if(!memory) {throw std::bad_alloc();}
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {free(memory);}
+void operator delete(void* memory, std::size_t) noexcept {free(memory);}
+
+struct BenchOptions{
+    std::string server{"http://127.0.0.1:8004/Sim-0001/v0/PublicAPI"};
+    size_t iterations{20000};
+    size_t requests{2000};
+    std::string filter;
+    std::string output;
+};
+
+struct BenchResult{
+    std::string name;
+    size_t iterations;
+    long long p50;
+    long long p99;
+    long long max;
+    double mean;
+    double allocsPerOp;
+    bool zeroAllocExpected;
+};
+
+//  Runs operation warmup + iterations times, timing every call on its own
+static BenchResult measure(const std::string& name, size_t iterations, const std::function<void()>& operation){
+    typedef std::chrono::steady_clock Clock;
+    for(size_t i = 0; i < iterations / 10 + 1; ++i) {operation();}
+
+    std::vector<long long> samples(iterations);
+    unsigned long long allocationsBefore = t_allocations;
+    for(size_t i = 0; i < iterations; ++i){
+        Clock::time_point start = Clock::now();
+        operation();
+        samples[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+    unsigned long long allocations = t_allocations - allocationsBefore;
+
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    double total = 0;
+    for(long long sample : samples) {total += sample;}
+    std::sort(samples.begin(), samples.end());
+    result.p50 = samples[iterations / 2];
+    result.p99 = samples[(std::min)(iterations - 1, iterations * 99 / 100)];
+    result.max = samples.back();
+    result.mean = total / iterations;
+    result.allocsPerOp = (double)allocations / iterations;
+    return result;
+}
+
+//  Runs the benchmark groups selected by the options, through the public API of the library only
+class TopasBench{
+public:
+    explicit TopasBench(const BenchOptions& options) : m_options(options), m_allocationFailures(0) {}
+
+    //  Returns the number of zero-allocation benchmarks that did allocate
+    int run(std::ostream& out){
+        runDiscovery(out);
+        runResponseParsing(out);
+        runInteractionSelection(out);
+        runEndToEnd(out);
+        runCircuitBreaker(out);
+        return m_allocationFailures;
+    }
+
+private:
+    const BenchOptions& m_options;
+    mutable int m_allocationFailures;
+
+    bool wanted(const std::string& name) const {
+        return m_options.filter.empty() || name.find(m_options.filter) != std::string::npos;
+    }
+
+    void report(std::ostream& out, const BenchResult& result) const {
+        json line = {
+            {"name", result.name},
+            {"iterations", result.iterations},
+            {"p50_ns", result.p50},
+            {"p99_ns", result.p99},
+            {"max_ns", result.max},
+            {"mean_ns", result.mean},
+            {"allocs_per_op", result.allocsPerOp},
+            {"zero_alloc_expected", result.zeroAllocExpected}
+        };
+        out << line.dump() << std::endl;
+    }
+
+    void bench(std::ostream& out, const std::string& name, size_t iterations, const std::function<void()>& operation, bool zeroAllocExpected = false) const {
+        if(!wanted(name)) {return;}
+        BenchResult result = measure(name, iterations, operation);
+        result.zeroAllocExpected = zeroAllocExpected;
+        report(out, result);
+        if(zeroAllocExpected && result.allocsPerOp > 0){
+            std::cerr << "[ERROR] " << name << " allocated " << result.allocsPerOp * result.iterations << " times in " << result.iterations << " iterations after warm-up" << std::endl;
+            ++m_allocationFailures;
+        }
+    }
+
+    //  Same shape as a real device's discovery reply (see discovery_responder.cc)
+    static std::string discoveryReply(int index){
+        char serial[32];
+        char guid[64];
+        snprintf(serial, sizeof(serial), "Sim-%04d", index);
+        snprintf(guid, sizeof(guid), "5e1f0000-0000-4000-8000-%012d", index);
+        json description = {
+            {"Identifier", "Topas4"},
+            {"SerialNumber", serial},
+            {"SenderGUID", guid},
+            {"PublicApiRestUrl_Version0", std::string("http://127.0.0.1:8004/") + serial + "/v0/PublicAPI"}
+        };
+        return description.dump();
+    }
+
+    //  TopasLocator::acceptReply for a new device (full parse) and for a repeated one (GUID pre-scan only)
+    void runDiscovery(std::ostream& out) const {
+        std::vector<std::string> replies;
+        for(int i = 0; i < 256; ++i) {replies.push_back(discoveryReply(i));}
+
+        std::unordered_set<std::string> seenGUIDS;
+        json description;
+        size_t next = 0;
+        bench(out, "discovery.accept_new", m_options.iterations, [&]{
+            if(next == replies.size()){
+                seenGUIDS.clear();
+                next = 0;
+            }
+            const std::string& reply = replies[next++];
+            TopasLocator::acceptReply(reply.c_str(), reply.size(), seenGUIDS, description);
+        });
+
+        seenGUIDS.clear();
+        for(const auto& reply : replies) {TopasLocator::acceptReply(reply.c_str(), reply.size(), seenGUIDS, description);}
+        next = 0;
+        bench(out, "discovery.reject_duplicate", m_options.iterations, [&]{
+            const std::string& reply = replies[next++ % replies.size()];
+            TopasLocator::acceptReply(reply.c_str(), reply.size(), seenGUIDS, description);
+        });
+    }
+
+    //  Canned bodies as returned by the device, parsed into a json DOM as the generic get() does, and through
+    //  TopasResponseDecoder
+    void runResponseParsing(std::ostream& out) const {
+        const std::string output = "{\"Interaction\":\"SIG\",\"Wavelength\":1300.0,\"IsWavelengthSettingInProgress\":false,"
+                                   "\"WavelengthSettingCompletionPart\":1.0,\"IsWaitingForUserAction\":false,\"Messages\":[]}";
+        const std::string shutter = "true";
+        const std::string interactions = sampleInteractions().dump();
+
+        float wavelength = 0;
+        bench(out, "http.parse_wavelength_output", m_options.iterations, [&]{
+            json data = json::parse(output);
+            wavelength += data["Wavelength"].get<float>();
+        });
+        bool open = false;
+        bench(out, "http.parse_shutter_status", m_options.iterations, [&]{
+            open ^= json::parse(shutter).get<bool>();
+        });
+        size_t count = 0;
+        bench(out, "http.parse_interactions", m_options.iterations, [&]{
+            count += json::parse(interactions).size();
+        });
+
+        //  The typed decoders TopasDevice uses for the same bodies, decoding into reused structs
+        WavelengthOutput status;
+        bench(out, "http.decode_wavelength_output", m_options.iterations, [&]{
+            TopasResponseDecoder::decodeWavelengthOutput(output, status);
+            wavelength += status.wavelength;
+        }, true);
+        bench(out, "http.decode_shutter_status", m_options.iterations, [&]{
+            bool isOpen = false;
+            TopasResponseDecoder::decodeShutterStatus(shutter, isOpen);
+            open ^= isOpen;
+        }, true);
+        std::vector<InteractionRange> ranges;
+        bench(out, "http.decode_interactions", m_options.iterations, [&]{
+            TopasResponseDecoder::decodeInteractions(interactions, ranges);
+            count += ranges.size();
+        }, true);
+    }
+
+    static json sampleInteractions(){
+        json interactions = json::array();
+        const char* types[] = {"SIG", "IDL", "SH-SIG", "SH-IDL", "SFG-SIG", "SFG-IDL", "FH-SIG", "FH-IDL"};
+        const float ranges[][2] = {{1150, 1600}, {1600, 2600}, {575, 800}, {800, 1300}, {475, 550}, {525, 580}, {287, 400}, {400, 650}};
+        for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i){
+            interactions.push_back({{"Type", types[i]}, {"OutputRange", {{"From", ranges[i][0]}, {"To", ranges[i][1]}}}});
+        }
+        return interactions;
+    }
+
+    //  What setWavelength(float) does once the interaction index is cached: candidates lookup and the policy
+    void runInteractionSelection(std::ostream& out) const {
+        TopasInteractionIndex index(sampleInteractions());
+        TopasInteractionIndex::SelectionPolicy policy = TopasInteractionIndex::preferCurrent();
+        const std::string current = "SIG";
+        TopasInteractionIndex::CurrentInteractionQuery currentInteraction = [&current]{ return current; };
+        float wavelength = 290;
+        int chosen = 0;
+        bench(out, "interactions.select", m_options.iterations, [&]{
+            wavelength = (wavelength > 2590) ? 290 : wavelength + 7.3f;
+            std::vector<InteractionRange> candidates = index.candidates(wavelength);
+            chosen += policy(candidates, wavelength, currentInteraction);
+        });
+
+        json document = sampleInteractions();
+        bench(out, "interactions.build_index", m_options.iterations, [&]{
+            TopasInteractionIndex rebuilt(document);
+            chosen += (int)rebuilt.interactions().size();
+        });
+    }
+
+    //  Against a live (mock) server: single reads, the concurrent snapshot, and the telemetry read HandlePeriodic does
+    void runEndToEnd(std::ostream& out) const {
+        if(!wanted("e2e.") && !wanted("periodic.")) {return;}
+
+        TopasDevice device;
+        {
+            //  the library reports its progress on stdout, keep that out of the results
+            std::ostringstream discard;
+            std::streambuf* saved = std::cout.rdbuf(discard.rdbuf());
+            device.initializeWithBaseAddress(m_options.server);
+            std::cout.rdbuf(saved);
+        }
+        if(!device.isInitialized()){
+            std::cerr << "[WARNING] No REST server at " << m_options.server << ", skipping the end-to-end benchmarks" << std::endl;
+            return;
+        }
+
+        //  The single reads use the prepared poll endpoints and must not allocate after warm-up
+        float wavelength = 0;
+        bench(out, "e2e.get_current_wavelength", m_options.requests, [&]{
+            wavelength += device.getCurrentWavelength();
+        }, true);
+        bench(out, "e2e.get_shutter_status", m_options.requests, [&]{
+            wavelength += (float)TopasDevice::ShutterStatusToBoolean(device.getShutterStatus());
+        }, true);
+        bench(out, "e2e.snapshot", m_options.requests, [&]{
+            wavelength += device.snapshot().wavelength;
+        });
+
+        if(!wanted("periodic.")) {return;}
+        device.setTelemetryMaxAge(std::chrono::milliseconds(2000));
+        device.startTelemetry(std::chrono::milliseconds(50));
+        for(int i = 0; i < 100 && !device.latestSnapshot().valid; ++i) {std::this_thread::sleep_for(std::chrono::milliseconds(10));}
+        bench(out, "periodic.latest_snapshot", m_options.iterations, [&]{
+            TopasDevice::Snapshot status = device.latestSnapshot();
+            if(status.valid && device.telemetryAge() <= std::chrono::milliseconds(2000)) {wavelength += status.wavelength;}
+        }, true);
+        bench(out, "periodic.get_current_wavelength", m_options.iterations, [&]{
+            wavelength += device.getCurrentWavelength();
+        }, true);
+        device.stopTelemetry();
+    }
+
+    //  Bookkeeping cost on the healthy path, and what a request costs while the device is down and the breaker open
+    void runCircuitBreaker(std::ostream& out) const {
+        if(!wanted("breaker.")) {return;}
+
+        TopasCircuitBreaker healthy("http://127.0.0.1:8004/bench/v0/PublicAPI");
+        int allowed = 0;
+        bench(out, "breaker.closed_request", m_options.iterations, [&]{
+            if(healthy.allowRequest()) {++allowed;}
+            healthy.recordResult(CURLE_OK, 200);
+        }, true);
+
+        //  Initialized against the server, then pointed at the discard port, where nothing listens. The breaker of
+        //  that address is opened by hand and never probes during the run.
+        TopasCommunicator communicator;
+        {
+            std::ostringstream discard;
+            std::streambuf* saved = std::cout.rdbuf(discard.rdbuf());
+            communicator.initializeWithBaseAddress(m_options.server);
+            std::cout.rdbuf(saved);
+        }
+        if(!communicator.isInitialized()){
+            std::cerr << "[WARNING] No REST server at " << m_options.server << ", skipping the open breaker benchmarks" << std::endl;
+            return;
+        }
+        communicator.setBaseAddress("http://127.0.0.1:9/unreachable/v0/PublicAPI");
+        std::shared_ptr<TopasCircuitBreaker> breaker = communicator.circuitBreaker();
+        breaker->setProbeDelay(std::chrono::hours(1), std::chrono::hours(1));
+        while(breaker->state() != TopasCircuitBreaker::State::OPEN) {breaker->recordResult(CURLE_COULDNT_CONNECT, 0);}
+
+        int endpoint = communicator.addPollEndpoint("/Optical/WavelengthControl/Output");
+        WavelengthOutput output;
+        int passed = 0;
+        bench(out, "breaker.open_poll", m_options.iterations, [&]{
+            if(communicator.poll(endpoint, [&output](const char* data, size_t length){ return TopasResponseDecoder::decodeWavelengthOutput(data, length, output); })) {++passed;}
+        }, true);
+        bench(out, "breaker.open_get", m_options.iterations, [&]{
+            if(!communicator.get("/ShutterInterlock/IsShutterOpen").is_null()) {++passed;}
+        });
+        if(passed > 0 || breaker->state() != TopasCircuitBreaker::State::OPEN) {std::cerr << "[WARNING] The open breaker let requests through" << std::endl;}
+    }
+};
+
+static bool parseOptions(int argc, char* argv[], BenchOptions& options){
+    for(int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if(arg == "--server" && hasValue) {options.server = argv[++i];}
+        else if(arg == "--iterations" && hasValue) {options.iterations = strtoul(argv[++i], nullptr, 10);}
+        else if(arg == "--requests" && hasValue) {options.requests = strtoul(argv[++i], nullptr, 10);}
+        else if(arg == "--filter" && hasValue) {options.filter = argv[++i];}
+        else if(arg == "--output" && hasValue) {options.output = argv[++i];}
+        else{
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.iterations > 0 && options.requests > 0;
+}
+
+int main(int argc, char* argv[]){
+    BenchOptions options;
+    if(!parseOptions(argc, argv, options)){
+        std::cerr << "See the top of bench.cc for the available options" << std::endl;
+        return 1;
+    }
+
+    std::ofstream file;
+    if(!options.output.empty()){
+        file.open(options.output.c_str());
+        if(!file){
+            std::cerr << "[ERROR] Could not open " << options.output << std::endl;
+            return 1;
+        }
+    }
+
+    TopasBench bench(options);
+    int allocationFailures = bench.run(options.output.empty() ? std::cout : file);
+    return (allocationFailures > 0) ? 2 : 0;
+}
@@ -0,0 +1,180 @@
+//  Fake Topas4 discovery responder, for testing and benchmarking TopasLocator without real devices.
+//  Listens on 239.0.0.181:7415 (and so also on the 127.255.255.255 localhost probe) and answers every
+//  "Topas4?" with one reply per simulated device.
+//
+//  usage: topas4_discovery_responder [options]
+//      --devices N         number of simulated devices (default 1)
+//      --duplicates N      extra copies of every reply (default 0)
+//      --loss P            probability [0,1] that a reply is dropped (default 0)
+//      --latency MS        delay before replying (default 0)
+//      --jitter MS         random extra delay up to MS (default 0)
+//      --malformed P       probability [0,1] that a reply is garbage instead of JSON (default 0)
+//      --rest-port PORT    port used in the advertised REST URLs (default 8004)
+//      --port PORT         discovery port to listen on (default 7415)
+//      --verbose           print every probe
+
+#include <queue>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include "TopasLocator.hh"
+
+#ifdef _WIN32
+    #define poll WSAPoll
+#else
+    #include <poll.h>
+#endif
+
+struct ResponderOptions{
+    int devices{1};
+    int duplicates{0};
+    double loss{0};
+    int latencyMs{0};
+    int jitterMs{0};
+    double malformed{0};
+    int restPort{8004};
+    int port{7415};
+    bool verbose{false};
+};
+
+//  One reply waiting for its simulated latency to pass
+struct PendingReply{
+    std::chrono::steady_clock::time_point due;
+    struct sockaddr_in destination;
+    std::string payload;
+    bool operator>(const PendingReply& other) const {return due > other.due;}
+};
+
+static bool parseOptions(int argc, char* argv[], ResponderOptions& options){
+    for(int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if(arg == "--verbose") {options.verbose = true;}
+        else if(arg == "--devices" && hasValue) {options.devices = atoi(argv[++i]);}
+        else if(arg == "--duplicates" && hasValue) {options.duplicates = atoi(argv[++i]);}
+        else if(arg == "--loss" && hasValue) {options.loss = atof(argv[++i]);}
+        else if(arg == "--latency" && hasValue) {options.latencyMs = atoi(argv[++i]);}
+        else if(arg == "--jitter" && hasValue) {options.jitterMs = atoi(argv[++i]);}
+        else if(arg == "--malformed" && hasValue) {options.malformed = atof(argv[++i]);}
+        else if(arg == "--rest-port" && hasValue) {options.restPort = atoi(argv[++i]);}
+        else if(arg == "--port" && hasValue) {options.port = atoi(argv[++i]);}
+        else{
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.devices > 0;
+}
+
+//  Same shape as a real device's reply, with made up but stable identifiers
+static std::string deviceDescription(int index, int restPort){
+    char serial[32];
+    char guid[64];
+    snprintf(serial, sizeof(serial), "Sim-%04d", index);
+    snprintf(guid, sizeof(guid), "5e1f0000-0000-4000-8000-%012d", index);
+    json description = {
+        {"Identifier", "Topas4"},
+        {"SerialNumber", serial},
+        {"SenderGUID", guid},
+        {"PublicApiRestUrl_Version0", "http://127.0.0.1:" + std::to_string(restPort) + "/" + serial + "/v0/PublicAPI"}
+    };
+    return description.dump();
+}
+
+int main(int argc, char* argv[]){
+    ResponderOptions options;
+    if(!parseOptions(argc, argv, options)){
+        std::cerr << "See the top of discovery_responder.cc for the available options" << std::endl;
+        return 1;
+    }
+
+    TopasLocator winsockGuard;  //  does WSAStartup/WSACleanup on Windows
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock == INVALID_SOCKET){
+        std::cerr << "Socket creation failed" << std::endl;
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    struct sockaddr_in localAddr;
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    localAddr.sin_port = htons((unsigned short)options.port);
+    if(bind(sock, (struct sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR){
+        std::cerr << "Failed to bind to port " << options.port << std::endl;
+        closesocket(sock);
+        return 1;
+    }
+
+    //  Join the discovery group; without a multicast route only the localhost probe will reach us
+    struct ip_mreq membership;
+    membership.imr_multiaddr.s_addr = inet_addr("239.0.0.181");
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR){
+        std::cerr << "[WARNING] Could not join 239.0.0.181, only answering unicast/localhost probes" << std::endl;
+    }
+
+    std::vector<std::string> descriptions;
+    for(int i = 1; i <= options.devices; ++i) {descriptions.push_back(deviceDescription(i, options.restPort));}
+
+    std::cout << "Simulating " << options.devices << " Topas4 device(s) on port " << options.port << std::endl;
+
+    std::mt19937 random(std::random_device{}());
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    std::uniform_int_distribution<int> jitter(0, options.jitterMs > 0 ? options.jitterMs : 0);
+    std::priority_queue<PendingReply, std::vector<PendingReply>, std::greater<PendingReply> > pending;
+    unsigned long long probes = 0, sent = 0, dropped = 0;
+    char buffer[512];
+
+    while(true){
+        //  Send everything whose latency has passed
+        auto now = std::chrono::steady_clock::now();
+        while(!pending.empty() && pending.top().due <= now){
+            const PendingReply& reply = pending.top();
+            sendto(sock, reply.payload.c_str(), (int)reply.payload.size(), 0, (const struct sockaddr*)&reply.destination, sizeof(reply.destination));
+            ++sent;
+            pending.pop();
+        }
+
+        int waitMs = -1;
+        if(!pending.empty()){
+            waitMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(pending.top().due - now).count() + 1;
+        }
+        struct pollfd pollEntry;
+        pollEntry.fd = sock;
+        pollEntry.events = POLLIN;
+        pollEntry.revents = 0;
+        if(poll(&pollEntry, 1, waitMs) <= 0 || !(pollEntry.revents & POLLIN)) {continue;}
+
+        struct sockaddr_in senderAddr;
+        socklen_t senderAddrSize = sizeof(senderAddr);
+        int bytesReceived = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&senderAddr, &senderAddrSize);
+        if(bytesReceived == SOCKET_ERROR) {continue;}
+        if(std::string(buffer, bytesReceived) != "Topas4?") {continue;}
+        ++probes;
+        if(options.verbose){
+            std::cout << "Probe #" << probes << " from " << inet_ntoa(senderAddr.sin_addr) << ":" << ntohs(senderAddr.sin_port);
+            std::cout << " (replies sent so far: " << sent << ", dropped: " << dropped << ")" << std::endl;
+        }
+
+        for(const auto& description : descriptions){
+            for(int copy = 0; copy <= options.duplicates; ++copy){
+                if(chance(random) < options.loss){
+                    ++dropped;
+                    continue;
+                }
+                PendingReply reply;
+                reply.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.latencyMs + jitter(random));
+                reply.destination = senderAddr;
+                reply.payload = (chance(random) < options.malformed) ? description.substr(0, description.size() / 2) : description;
+                pending.push(reply);
+            }
+        }
+    }
+
+    closesocket(sock);
+    return 0;
+}
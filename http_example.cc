@@ -31,6 +31,10 @@ int main(){
 
     TopasLocator* topasLocator = new TopasLocator();
     std::vector<json> devices = topasLocator->locate();
+    if(devices.empty()){
+        //  routed networks may drop multicast, so probe every host of the instrument subnet directly
+        devices = topasLocator->sweep({"142.90.111.0/24"});
+    }
     printDevices(devices);
     delete topasLocator;
 
@@ -45,7 +49,7 @@ int main(){
     res = httpCommunicator->get(SHUTTER_STATUS_ADDRESS);
     PrintHttpResponse(res);
 
-    res = httpCommunicator->get("/Authentication/UsersWithAccessRights");
+    res = httpCommunicator->getStreamed("/Authentication/UsersWithAccessRights");
     PrettyPrintHttpResponse(res);
 
     delete httpCommunicator;
@@ -0,0 +1,397 @@
+//  Mock Topas4 REST server, for measuring TopasCommunicator/TopasDevice request rates and latency without an OPA.
+//  Implements the endpoints this library uses under any base path (e.g. http://127.0.0.1:8004/Sim-0001/v0/PublicAPI):
+//      GET  /Optical/WavelengthControl/Output
+//      PUT  /Optical/WavelengthControl/SetWavelength
+//      GET  /Optical/WavelengthControl/ExpandedInteractions                 (with ETag / If-None-Match)
+//      PUT  /Optical/WavelengthControl/FinishWavelengthSettingAfterUserActions
+//      PUT  /ShutterInterlock/OpenCloseShutter
+//      GET  /ShutterInterlock/IsShutterOpen
+//  A wavelength change moves over time and can stop halfway asking for a user action.
+//
+//  usage: topas4_mock_server [options]
+//      --port PORT         listen port (default 8004)
+//      --latency MS        delay added to every response (default 0)
+//      --jitter MS         random extra delay up to MS (default 0)
+//      --error-rate P      probability [0,1] of answering with an error instead (default 0)
+//      --error-status CODE HTTP status of those errors, e.g. 503 to exercise client retries (default 500)
+//      --user-action P     probability [0,1] that a wavelength change needs a user action (default 0)
+//      --move-time MS      base duration of a wavelength change (default 500)
+//      --ms-per-nm MS      extra duration per nm of change (default 1)
+//      --verbose           print every request
+
+#include <mutex>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include "TopasLocator.hh"
+
+#ifndef _WIN32
+    #include <netinet/tcp.h>
+#endif
+
+struct ServerOptions{
+    int port{8004};
+    int latencyMs{0};
+    int jitterMs{0};
+    double errorRate{0};
+    int errorStatus{500};
+    double userAction{0};
+    int moveTimeMs{500};
+    double msPerNm{1};
+    bool verbose{false};
+};
+
+struct HttpRequest{
+    std::string method;
+    std::string path;
+    std::string body;
+    std::string ifNoneMatch;
+    bool keepAlive;
+};
+
+struct HttpResponse{
+    int status;
+    std::string body;
+    std::string etag;
+};
+
+//  Simulated device state. Everything is derived from the time the current move started.
+class MockDevice{
+public:
+    explicit MockDevice(const ServerOptions& options) : m_options(options), m_random(std::random_device{}()) {
+        m_interactions = json::array({
+            {{"Type", "SIG"}, {"OutputRange", {{"From", 1150.0}, {"To", 1600.0}}}},
+            {{"Type", "IDL"}, {"OutputRange", {{"From", 1600.0}, {"To", 2600.0}}}},
+            {{"Type", "SH-SIG"}, {"OutputRange", {{"From", 575.0}, {"To", 800.0}}}},
+            {{"Type", "SH-IDL"}, {"OutputRange", {{"From", 800.0}, {"To", 1300.0}}}}
+        });
+        m_interaction = "SIG";
+        m_wavelength = 1300;
+        m_moveFrom = m_wavelength;
+        m_moving = false;
+        m_waitingForUser = false;
+        m_userActionAt = 2;
+        m_shutterOpen = false;
+        m_shutterBeforeUserAction = false;
+    }
+
+    HttpResponse handle(const HttpRequest& request){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        update();
+        const std::string& path = request.path;
+        if(endsWith(path, "/Optical/WavelengthControl/Output") && request.method == "GET") {return ok(output());}
+        if(endsWith(path, "/Optical/WavelengthControl/ExpandedInteractions") && request.method == "GET"){
+            HttpResponse response = ok(m_interactions);
+            response.etag = "\"interactions-v1\"";
+            if(request.ifNoneMatch == response.etag){
+                response.status = 304;
+                response.body.clear();
+            }
+            return response;
+        }
+        if(endsWith(path, "/Optical/WavelengthControl/SetWavelength") && request.method == "PUT") {return setWavelength(request.body);}
+        if(endsWith(path, "/Optical/WavelengthControl/FinishWavelengthSettingAfterUserActions") && request.method == "PUT") {return finishUserActions(request.body);}
+        if(endsWith(path, "/ShutterInterlock/OpenCloseShutter") && request.method == "PUT") {return setShutter(request.body);}
+        if(endsWith(path, "/ShutterInterlock/IsShutterOpen") && request.method == "GET") {return ok(m_shutterOpen);}
+        return error(404, "Unknown endpoint " + request.method + " " + path);
+    }
+
+private:
+    const ServerOptions& m_options;
+    std::mutex m_mutex;
+    std::mt19937 m_random;
+    json m_interactions;
+
+    std::string m_interaction;
+    double m_wavelength;
+    double m_moveFrom;
+    double m_moveTo;
+    bool m_moving;
+    std::chrono::steady_clock::time_point m_moveStart;
+    std::chrono::milliseconds m_moveDuration;
+    bool m_waitingForUser;
+    double m_userActionAt;  //  completion part at which the user action is requested (> 1 means never)
+    std::chrono::steady_clock::duration m_pausedFor;
+    std::chrono::steady_clock::time_point m_pauseStart;
+    bool m_shutterOpen;
+    bool m_shutterBeforeUserAction;
+
+    static bool endsWith(const std::string& text, const std::string& suffix){
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static HttpResponse ok(const json& body){
+        HttpResponse response;
+        response.status = 200;
+        response.body = body.dump();
+        return response;
+    }
+
+    static HttpResponse error(int status, const std::string& message){
+        HttpResponse response;
+        response.status = status;
+        response.body = json({{"Message", message}}).dump();
+        return response;
+    }
+
+    double completionPart() const {
+        if(!m_moving) {return 1.0;}
+        auto now = m_waitingForUser ? m_pauseStart : std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double, std::milli>(now - m_moveStart - m_pausedFor).count();
+        double part = elapsed / (double)m_moveDuration.count();
+        return part < 1.0 ? part : 1.0;
+    }
+
+    //  Advances the move: pauses for the user action, or finishes it
+    void update(){
+        if(!m_moving || m_waitingForUser) {return;}
+        double part = completionPart();
+        if(part >= m_userActionAt){
+            m_waitingForUser = true;
+            m_pauseStart = std::chrono::steady_clock::now();
+            m_userActionAt = 2;
+            m_shutterBeforeUserAction = m_shutterOpen;
+            m_shutterOpen = false;
+            return;
+        }
+        m_wavelength = m_moveFrom + (m_moveTo - m_moveFrom) * part;
+        if(part >= 1.0){
+            m_wavelength = m_moveTo;
+            m_moving = false;
+        }
+    }
+
+    json output() const {
+        json messages = json::array();
+        if(m_waitingForUser){
+            messages.push_back({{"Text", "Please adjust the mock crystal and confirm."}, {"Image", nullptr}});
+        }
+        return {
+            {"Interaction", m_interaction},
+            {"Wavelength", m_wavelength},
+            {"IsWavelengthSettingInProgress", m_moving},
+            {"WavelengthSettingCompletionPart", m_moving ? completionPart() : 1.0},
+            {"IsWaitingForUserAction", m_waitingForUser},
+            {"Messages", messages}
+        };
+    }
+
+    HttpResponse setWavelength(const std::string& body){
+        json data = json::parse(body, nullptr, false);
+        if(data.is_discarded() || !data.contains("Interaction") || !data.contains("Wavelength") || !data["Wavelength"].is_number()){
+            return error(400, "Expected {\"Interaction\": ..., \"Wavelength\": ...}");
+        }
+        double target = data["Wavelength"].get<double>();
+        for(const auto& item : m_interactions){
+            if(item["Type"] != data["Interaction"]) {continue;}
+            if(target < item["OutputRange"]["From"].get<double>() || target > item["OutputRange"]["To"].get<double>()){
+                return error(400, "Wavelength out of range for interaction");
+            }
+            std::uniform_real_distribution<double> chance(0.0, 1.0);
+            m_interaction = item["Type"].get<std::string>();
+            m_moveFrom = m_wavelength;
+            m_moveTo = (float)target;  //  the real device reports back the float it was given
+            m_moveStart = std::chrono::steady_clock::now();
+            m_moveDuration = std::chrono::milliseconds(m_options.moveTimeMs + (long long)(std::fabs(m_moveTo - m_moveFrom) * m_options.msPerNm));
+            m_pausedFor = std::chrono::steady_clock::duration::zero();
+            m_moving = true;
+            m_waitingForUser = false;
+            m_userActionAt = (chance(m_random) < m_options.userAction) ? 0.5 : 2;
+            return ok(json::object());
+        }
+        return error(400, "Unknown interaction");
+    }
+
+    HttpResponse finishUserActions(const std::string& body){
+        if(!m_waitingForUser) {return error(400, "No user action is pending");}
+        json data = json::parse(body, nullptr, false);
+        m_pausedFor += std::chrono::steady_clock::now() - m_pauseStart;
+        m_waitingForUser = false;
+        if(!data.is_discarded() && data.value("RestoreShutter", false)) {m_shutterOpen = m_shutterBeforeUserAction;}
+        return ok(json::object());
+    }
+
+    HttpResponse setShutter(const std::string& body){
+        json data = json::parse(body, nullptr, false);
+        if(data.is_discarded() || !data.is_boolean()) {return error(400, "Expected true or false");}
+        m_shutterOpen = data.get<bool>();
+        return ok(json::object());
+    }
+};
+
+static bool parseOptions(int argc, char* argv[], ServerOptions& options){
+    for(int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if(arg == "--verbose") {options.verbose = true;}
+        else if(arg == "--port" && hasValue) {options.port = atoi(argv[++i]);}
+        else if(arg == "--latency" && hasValue) {options.latencyMs = atoi(argv[++i]);}
+        else if(arg == "--jitter" && hasValue) {options.jitterMs = atoi(argv[++i]);}
+        else if(arg == "--error-rate" && hasValue) {options.errorRate = atof(argv[++i]);}
+        else if(arg == "--error-status" && hasValue) {options.errorStatus = atoi(argv[++i]);}
+        else if(arg == "--user-action" && hasValue) {options.userAction = atof(argv[++i]);}
+        else if(arg == "--move-time" && hasValue) {options.moveTimeMs = atoi(argv[++i]);}
+        else if(arg == "--ms-per-nm" && hasValue) {options.msPerNm = atof(argv[++i]);}
+        else{
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//  Reads one request from the connection. buffer keeps whatever was received past it (pipelining).
+static bool readRequest(SOCKET client, std::string& buffer, HttpRequest& request){
+    char chunk[4096];
+    size_t headerEnd;
+    while((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos){
+        int received = recv(client, chunk, sizeof(chunk), 0);
+        if(received <= 0) {return false;}
+        buffer.append(chunk, received);
+    }
+
+    std::string head = buffer.substr(0, headerEnd);
+    size_t lineEnd = head.find("\r\n");
+    std::string requestLine = head.substr(0, lineEnd);
+    size_t firstSpace = requestLine.find(' ');
+    size_t secondSpace = requestLine.find(' ', firstSpace + 1);
+    if(firstSpace == std::string::npos || secondSpace == std::string::npos) {return false;}
+    request.method = requestLine.substr(0, firstSpace);
+    request.path = requestLine.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+    request.keepAlive = requestLine.compare(secondSpace + 1, std::string::npos, "HTTP/1.0") != 0;
+    request.ifNoneMatch.clear();
+
+    size_t contentLength = 0;
+    size_t position = (lineEnd == std::string::npos) ? head.size() : lineEnd + 2;
+    while(position < head.size()){
+        size_t next = head.find("\r\n", position);
+        if(next == std::string::npos) {next = head.size();}
+        std::string line = head.substr(position, next - position);
+        position = next + 2;
+
+        size_t colon = line.find(':');
+        if(colon == std::string::npos) {continue;}
+        std::string name = line.substr(0, colon);
+        for(auto& c : name) {c = (char)tolower((unsigned char)c);}
+        size_t valueStart = line.find_first_not_of(' ', colon + 1);
+        std::string value = (valueStart == std::string::npos) ? "" : line.substr(valueStart);
+
+        if(name == "content-length") {contentLength = (size_t)strtoul(value.c_str(), nullptr, 10);}
+        else if(name == "if-none-match") {request.ifNoneMatch = value;}
+        else if(name == "connection" && (value == "close" || value == "Close")) {request.keepAlive = false;}
+    }
+
+    size_t bodyStart = headerEnd + 4;
+    while(buffer.size() < bodyStart + contentLength){
+        int received = recv(client, chunk, sizeof(chunk), 0);
+        if(received <= 0) {return false;}
+        buffer.append(chunk, received);
+    }
+    request.body = buffer.substr(bodyStart, contentLength);
+    buffer.erase(0, bodyStart + contentLength);
+    return true;
+}
+
+static bool sendAll(SOCKET client, const std::string& data){
+    size_t sent = 0;
+    while(sent < data.size()){
+        int result = send(client, data.c_str() + sent, (int)(data.size() - sent), 0);
+        if(result <= 0) {return false;}
+        sent += result;
+    }
+    return true;
+}
+
+static const char* reasonPhrase(int status){
+    switch(status){
+        case 200: return "OK";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Internal Server Error";
+    }
+}
+
+//  One thread per connection; connections are kept alive like the pooled CURL handles expect
+static void serveConnection(SOCKET client, MockDevice& device, const ServerOptions& options, std::atomic<unsigned long long>& requestCount){
+    std::mt19937 random(std::random_device{}());
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    std::uniform_int_distribution<int> jitter(0, options.jitterMs > 0 ? options.jitterMs : 0);
+    std::string buffer;
+    HttpRequest request;
+
+    while(readRequest(client, buffer, request)){
+        unsigned long long number = ++requestCount;
+        if(options.verbose) {std::cout << "#" << number << " " << request.method << " " << request.path << std::endl;}
+
+        int delayMs = options.latencyMs + jitter(random);
+        if(delayMs > 0) {std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));}
+
+        HttpResponse response;
+        if(chance(random) < options.errorRate){
+            response.status = options.errorStatus;
+            response.body = "{\"Message\":\"Injected error\"}";
+        } else {
+            response = device.handle(request);
+        }
+
+        std::string reply = "HTTP/1.1 " + std::to_string(response.status) + " " + reasonPhrase(response.status) + "\r\n";
+        reply += "Content-Type: application/json\r\n";
+        reply += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+        if(!response.etag.empty()) {reply += "ETag: " + response.etag + "\r\n";}
+        reply += request.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        reply += response.body;
+        if(!sendAll(client, reply) || !request.keepAlive) {break;}
+    }
+    closesocket(client);
+}
+
+int main(int argc, char* argv[]){
+    ServerOptions options;
+    if(!parseOptions(argc, argv, options)){
+        std::cerr << "See the top of mock_server.cc for the available options" << std::endl;
+        return 1;
+    }
+
+    TopasLocator winsockGuard;  //  does WSAStartup/WSACleanup on Windows
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener == INVALID_SOCKET){
+        std::cerr << "Socket creation failed" << std::endl;
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    struct sockaddr_in localAddr;
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    localAddr.sin_port = htons((unsigned short)options.port);
+    if(bind(listener, (struct sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR || listen(listener, 64) == SOCKET_ERROR){
+        std::cerr << "Failed to listen on port " << options.port << std::endl;
+        closesocket(listener);
+        return 1;
+    }
+
+    std::cout << "Mock Topas4 REST server listening on http://127.0.0.1:" << options.port << "/<serial>/v0/PublicAPI" << std::endl;
+
+    MockDevice device(options);
+    std::atomic<unsigned long long> requestCount(0);
+    while(true){
+        SOCKET client = accept(listener, nullptr, nullptr);
+        if(client == INVALID_SOCKET) {continue;}
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        std::thread(serveConnection, client, std::ref(device), std::cref(options), std::ref(requestCount)).detach();
+    }
+
+    closesocket(listener);
+    return 0;
+}